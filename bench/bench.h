@@ -0,0 +1,104 @@
+// Helpers shared by the benchmarks.
+// Results are printed as one JSON object per line, like:
+// {"bench":"escape_text/clean","config":"compact,bufsize=1024","ns_per_op":812.3,"mb_per_s":80.1,"sink_calls_per_op":4.0,"allocs_per_op":0.0}
+// so that the results of two versions can be compared by a script.
+// Must be included before ctml.h, as it counts the allocations of ctml.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Minimum time spent running every benchmark.
+#ifndef BENCH_MIN_SECONDS
+	#define BENCH_MIN_SECONDS 0.2
+#endif
+
+static size_t bench_allocs;
+
+static void* bench_malloc(size_t size) {
+	bench_allocs++;
+	return malloc(size);
+}
+
+static void* bench_realloc(void* ptr, size_t size) {
+	bench_allocs++;
+	return realloc(ptr, size);
+}
+
+#define CTML_MALLOC(size) bench_malloc(size)
+#define CTML_REALLOC(ptr, size) bench_realloc(ptr, size)
+#define CTML_FREE(ptr) free(ptr)
+
+// Sink doing nothing so only ctml is measured.
+static size_t bench_sink_calls;
+static size_t bench_sink_bytes;
+
+static int bench_sink(const char* data, size_t length, void* userData) {
+	(void)data;
+	(void)userData;
+	bench_sink_calls++;
+	bench_sink_bytes += length;
+	return 0;
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef CTML_PRETTY
+	#define BENCH_MODE "pretty"
+#else
+	#define BENCH_MODE "compact"
+#endif
+#ifdef BENCH_DEFLATE
+	#define BENCH_CODEC ",gzip"
+#else
+	#define BENCH_CODEC ""
+#endif
+#ifdef CTML_SINK_BUFSIZE
+	#define BENCH_STR1(x) #x
+	#define BENCH_STR(x) BENCH_STR1(x)
+	#define BENCH_CONFIG BENCH_MODE BENCH_CODEC ",bufsize=" BENCH_STR(CTML_SINK_BUFSIZE)
+#else
+	#define BENCH_CONFIG BENCH_MODE BENCH_CODEC ",bufsize=default"
+#endif
+
+// Prints a result. bytes is what one op processes (0 if it does not apply).
+static void bench_report(const char* name, size_t ops, double elapsed, size_t bytes, size_t sink_calls, size_t allocs) {
+	printf("{\"bench\":\"%s\",\"config\":\"%s\",\"ns_per_op\":%.1f,\"mb_per_s\":%.1f,"
+	       "\"sink_calls_per_op\":%.2f,\"allocs_per_op\":%.2f}\n",
+		name, BENCH_CONFIG, elapsed * 1e9 / ops,
+		bytes ? (double)bytes * ops / elapsed / 1e6 : 0.0,
+		(double)sink_calls / ops, (double)allocs / ops);
+	fflush(stdout);
+}
+
+// Runs op until BENCH_MIN_SECONDS are spent and reports it. bytes is what
+// one op processes, when 0 it is what one op sends to the sink.
+static void bench_run(const char* name, size_t bytes, void (*op)(void)) {
+	size_t ops = 0;
+	double start, elapsed;
+	bench_sink_bytes = 0;
+	op(); // Warm up
+	if (bytes == 0) {
+		bytes = bench_sink_bytes;
+	}
+	bench_sink_calls = 0;
+	bench_allocs = 0;
+	start = bench_now();
+	do {
+		for (int i = 0; i < 16; i++) {
+			op();
+		}
+		ops += 16;
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_MIN_SECONDS);
+	bench_report(name, ops, elapsed, bytes, bench_sink_calls, bench_allocs);
+}
+
+#endif // BENCH_H
@@ -0,0 +1,81 @@
+// Microbenchmark of ctml_escape_text.
+// Reports the throughput of every available scanner and of the
+// full escaping path on clean, sparse and dense inputs (see bench.h
+// for the output format).
+//
+// gcc -O2 -I.. escape_bench.c -o escape_bench && ./escape_bench
+#include "bench.h"
+#define CTML_IMPLEMENTATION
+#include "ctml.h"
+
+#define INPUT_SIZE (64 * 1024)
+
+// Fills input with text where one char every `every` chars has to be escaped
+// (never if every is 0).
+static void fill(char* input, size_t length, int every) {
+	const char* clean = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ";
+	const char* special = "<>&\"'";
+	for (size_t i = 0; i < length; i++) {
+		input[i] = clean[i % 57];
+		if (every && i % every == 0) {
+			input[i] = special[(i / every) % 5];
+		}
+	}
+	input[length] = '\0';
+}
+
+typedef size_t (*scanner)(const char* text, size_t length);
+
+static char input[INPUT_SIZE + 1];
+static scanner current_scanner;
+static size_t found;
+
+static void scan(void) {
+	// Scans the whole input, as ctml_escape_textn would.
+	size_t i = 0;
+	while (i < INPUT_SIZE) {
+		i += current_scanner(input + i, INPUT_SIZE - i) + 1;
+		found++;
+	}
+}
+
+static void escape(void) {
+	ctml(.write = bench_sink) {
+		ctml_text(input);
+	}
+}
+
+static void bench_scan(const char* name, const char* input_name, scanner s) {
+	char full_name[64];
+	snprintf(full_name, sizeof(full_name), "scan/%s/%s", name, input_name);
+	current_scanner = s;
+	bench_run(full_name, INPUT_SIZE, scan);
+}
+
+int main(void) {
+	static const struct {
+		const char* name;
+		int every;
+	} inputs[] = {
+		{"clean", 0},
+		{"sparse", 64},
+		{"dense", 2},
+	};
+
+	for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		char name[64];
+		fill(input, INPUT_SIZE, inputs[i].every);
+		bench_scan("scalar", inputs[i].name, ctml_escape_scan_scalar);
+		#ifdef CTML_ESCAPE_SIMD
+			bench_scan("sse2", inputs[i].name, ctml_escape_scan_sse2);
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) {
+				bench_scan("avx2", inputs[i].name, ctml_escape_scan_avx2);
+			}
+		#endif
+		snprintf(name, sizeof(name), "ctml_text/%s", inputs[i].name);
+		bench_run(name, INPUT_SIZE, escape);
+	}
+	if (found == 0) abort();
+	return 0;
+}
@@ -0,0 +1,148 @@
+// Benchmarks of the rendering hot paths: escaping, tags, buffered output,
+// formatting and full pages. Built for every configuration by `make bench`,
+// see bench.h for the output format.
+//
+// gcc -O2 -I.. [-DCTML_PRETTY] [-DCTML_SINK_BUFSIZE=n] [-DBENCH_DEFLATE] render_bench.c -o render_bench -lz && ./render_bench
+#include "bench.h"
+#define CTML_IMPLEMENTATION
+#include "ctml.h"
+
+#ifdef BENCH_DEFLATE
+	// Pages are gzipped (level 6, sent at every flush of the buffer).
+	#include "ctml_deflate.h"
+	static CTML_Deflate bench_deflate = CTML_DEFLATE_INIT(6, CTML_DEFLATE_GZIP, CTML_DEFLATE_FLUSH_BUFFER);
+	#define BENCH_OUTPUT .write = bench_sink, .codec = &bench_deflate.codec
+#else
+	#define BENCH_OUTPUT .write = bench_sink
+#endif
+
+// Context shared by the benchmarks of single operations, so that
+// they do not measure the creation of a context.
+static CTML_Context bench_context = {BENCH_OUTPUT};
+
+#define TEXT_SIZE 4096
+static char clean_text[TEXT_SIZE + 1];
+static char mixed_text[TEXT_SIZE + 1];
+
+static void fill(char* text, int every) {
+	const char* clean = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ";
+	const char* special = "<>&\"'";
+	for (int i = 0; i < TEXT_SIZE; i++) {
+		text[i] = clean[i % 57];
+		if (every && i % every == 0) {
+			text[i] = special[(i / every) % 5];
+		}
+	}
+	text[TEXT_SIZE] = '\0';
+}
+
+static void escape_clean(void) {
+	CTML_Context* ctx = &bench_context;
+	ctml_escape_textn(ctx, clean_text, TEXT_SIZE);
+}
+
+static void escape_mixed(void) {
+	CTML_Context* ctx = &bench_context;
+	ctml_escape_textn(ctx, mixed_text, TEXT_SIZE);
+}
+
+static const char* dynamic_id = "main";
+
+static void open_close_tag(void) {
+	CTML_Context* ctx = &bench_context;
+	h(div, .class="box", .id=dynamic_id) {}
+}
+
+static void buffered_output(void) {
+	CTML_Context* ctx = &bench_context;
+	ctml_buffered_ctml_output(ctx, clean_text, 32);
+}
+
+static void rawf(void) {
+	CTML_Context* ctx = &bench_context;
+	ctml_rawf("<td>%d</td><td>%s</td>", 12345, "name");
+}
+
+static void landing_page(void) {
+	ctml(BENCH_OUTPUT) {
+		ctml_raw("<!DOCTYPE html>");
+		h(html, .lang="en") {
+			h(head) {
+				h(title) { ctml_raw("Landing page"); }
+				hh(link, .type="text/css", .src="style.css")
+			}
+			h(body) {
+				h(nav, .class="nav") {
+					for (int i = 0; i < 5; i++) {
+						h(a, .class="nav-item") { ctml_textf("Item %d", i); }
+					}
+				}
+				h(div, .class="hero") {
+					h(h1) { ctml_text("Render HTML from C"); }
+					h(p) { ctml_text("Fast, small & without dependencies <really>."); }
+				}
+				h(footer) { ctml_raw("&copy; ctml"); }
+			}
+		}
+	}
+}
+
+static void table_10k(void) {
+	ctml(BENCH_OUTPUT) {
+		h(table, .class="data") {
+			for (int i = 0; i < 10000; i++) {
+				h(tr, .class=(i & 1) ? "odd" : "even") {
+					h(td) { ctml_int(i); }
+					h(td) { ctml_text("row name & <data>"); }
+					h(td) { ctml_double(i * 0.25, 2); }
+				}
+			}
+		}
+	}
+}
+
+static void nested(CTML_Context* ctx, int depth) {
+	if (depth == 0) {
+		ctml_text("leaf");
+		return;
+	}
+	h(div, .class="node") {
+		nested(ctx, depth - 1);
+		nested(ctx, depth - 1);
+	}
+}
+
+static void nested_tree(void) {
+	ctml(BENCH_OUTPUT) {
+		nested(ctx, 10);
+	}
+}
+
+// Bytes written by an op on bench_context.
+static size_t output_size(void (*op)(void)) {
+	ctml_flush_buffer(&bench_context);
+	bench_sink_bytes = 0;
+	for (int i = 0; i < 16; i++) {
+		op();
+	}
+	ctml_flush_buffer(&bench_context);
+	return bench_sink_bytes / 16;
+}
+
+int main(void) {
+	fill(clean_text, 0);
+	fill(mixed_text, 16);
+	ctml_begin(&bench_context);
+
+	bench_run("escape_text/clean", TEXT_SIZE, escape_clean);
+	bench_run("escape_text/mixed", TEXT_SIZE, escape_mixed);
+	bench_run("open_close_tag", output_size(open_close_tag), open_close_tag);
+	bench_run("buffered_output/32B", 32, buffered_output);
+	bench_run("rawf", output_size(rawf), rawf);
+	ctml_flush_buffer(&bench_context);
+
+	bench_run("page/landing", 0, landing_page);
+	bench_run("page/table_10k", 0, table_10k);
+	bench_run("page/nested_tree", 0, nested_tree);
+	return 0;
+}
@@ -81,14 +81,176 @@ This code will print this html on stdout:
 </html>
 ```
 
-NOTE: The sink function is a `void *(sink) (char*, void* userData)` where ctml
-will send the generated HTML.
+NOTE: The sink function is an `int (*sink) (const char* data, size_t length, void* userData)`
+given with `.write = ...` where ctml will send the generated HTML. `data` is NOT
+'\0' terminated, `length` must be used instead.
 CTML will send data in multiple batches and not only once with the
-full generated HTML. 
+full generated HTML. Writes bigger than the buffer (see [Configuration](#configuration))
+are sent to the sink directly, without being copied.
 
 The sink function also takes `void* userData` with user data
 given to `ctml()` using `.userData = ...`
 
+The sink returns 0, or anything else when it failed (like a client that
+disconnected). The rendering is then stopped: nothing is sent to the sink
+anymore, writes do nothing and the content of the tags (`h()` blocks) is
+skipped, so the rest of the page costs almost nothing. `ctx->failed` is set,
+and is still readable as `ctml_context.failed` once `ctml()` is done:
+
+```c
+ctml(.write = socket_sink, .userData = &client_fd) { ... }
+if (ctml_context.failed) { ... }
+```
+
+Loops of the template can check `ctx->failed` to stop even earlier.
+
+The older `void (*sink) (char*, void* userData)` receiving '\0' terminated
+strings is still supported using `.sink = ...` (it cannot report failures).
+
+### Rendering to memory
+
+Instead of a sink, a `CTML_Arena` can be given with `.arena = ...`. The HTML
+is then rendered directly inside of it (without going through another buffer)
+and is available as one '\0' terminated string once `ctml()` is done:
+
+```c
+CTML_Arena arena = {0};
+ctml(.arena = &arena) {
+    h(div) { ctml_text("hello"); }
+}
+// arena.data and arena.length contain the HTML
+ctml_arena_reset(&arena); // Before rendering again (the memory is kept)
+ctml_arena_free(&arena);  // When done with it
+```
+
+The arena is contiguous and grows by chunks of at least `CTML_ARENA_CHUNK`
+bytes (64KB by default). As `ctml_arena_reset` keeps the memory, an arena
+reused between requests stops allocating once it is big enough.
+`arena.peak` is the biggest length it reached and `arena.allocations` the
+number of times it had to allocate, which helps to size it upfront with
+`ctml_arena_reserve(&arena, size)`. Rendering without reset appends to
+what the arena already contains. If memory cannot be allocated,
+`arena.failed` is set and the HTML is truncated.
+With `CTML_NOLIBC`, arenas cannot allocate unless `CTML_REALLOC` and `CTML_FREE`
+are defined, but fixed memory can be given through `arena.data` and `arena.capacity`.
+
+### Scatter-gather output
+
+When `CTML_IOVEC` is defined, an `int (*writev) (const struct iovec* iov, int count, void* userData)`
+sink can be given with `.writev = ...`. It receives batches of chunks that can be sent
+with a single `writev` (or `sendmsg`). String literals of at least `CTML_IOVEC_MIN_REF`
+bytes (64 by default), like big `ctml_raw` blocks of CSS or JS, are put in the batch
+by reference instead of being copied in the buffer. Everything else is buffered as
+usual. A batch is sent when the buffer is full, when it holds `CTML_IOVEC_MAX` entries
+(64 by default) or at the end of `ctml()`.
+
+### Chunked transfer encoding
+
+With `.chunked = 1`, the HTML is sent with the HTTP/1.1 chunked transfer encoding,
+so a page can be streamed over a persistent connection without knowing its length
+(send `Transfer-Encoding: chunked` in the headers first):
+
+```c
+ctml(.write = socket_sink, .userData = &client_fd, .chunked = 1) { ... }
+```
+
+Every flush of the buffer becomes one chunk, sent with a single sink call (room is
+kept around the buffer for the chunk header and end). With `.writev`, a whole
+batch is one chunk, its header and end being entries of the same `writev`.
+The last chunk (`0\r\n\r\n`) is sent
+when `ctml()` is done. `.chunked` is ignored when rendering to an arena.
+
+### Compression
+
+A codec can be put between the buffer and the sink with `.codec = ...`. It receives
+every flush of the buffer and sends what it produces to the sink (before the chunked
+encoding, if any). `ctml_deflate.h` (needs zlib, `-lz`) provides gzip, zlib and raw
+deflate codecs:
+
+```c
+#include "ctml_deflate.h" // Before ctml_short.h, like any other header
+
+static _Thread_local CTML_Deflate gzip = CTML_DEFLATE_INIT(6, CTML_DEFLATE_GZIP, CTML_DEFLATE_FLUSH_BUFFER);
+ctml(.write = socket_sink, .userData = &client_fd, .chunked = 1, .codec = &gzip.codec) { ... }
+```
+
+The first argument is the zlib level. With `CTML_DEFLATE_FLUSH_BUFFER`, every flush
+of the buffer is sent right away (`Z_SYNC_FLUSH`) so pages keep streaming, while
+`CTML_DEFLATE_FLUSH_END` only sends compressed data when its output buffer
+(`CTML_DEFLATE_BUFSIZE`, 16KB) is full, on `ctml_flush` and at the end, for a
+better ratio and fewer sink calls. The zlib
+state is allocated once and reset after every rendering, so a `CTML_Deflate` per
+thread does not allocate per request (`ctml_deflate_free` releases it).
+`bytesIn` and `bytesOut` count what it compressed. Other codecs implement
+`CTML_Codec.encode` and send their output with `ctml_codec_output`. As the output
+is binary, codecs need a `.write` or `.writev` sink.
+
+### Flushing
+
+The HTML reaches the sink when the buffer is full and at the end of `ctml()`.
+`ctml_flush(ctx)` sends everything written so far right away, including what
+the codec holds (a `CTML_CODEC_FLUSH`, a sync flush for `ctml_deflate.h`). For
+instance, the `<head>` can reach the browser (which starts loading the
+stylesheets) before the queries of the body are run:
+
+```c
+ctml(.write = socket_sink, .userData = &client_fd) {
+    html() {
+        head() { ... }
+        ctml_flush(ctx);
+        body() { ... } // Expensive
+    }
+}
+```
+
+`.bufferSize = n` buffers at most `n` bytes (up to the size of the buffer
+minus one, the default) for that context only. An auto-flush policy can also be given
+per context, trading sink calls for time to first byte: `.flushBytes = n`
+calls `ctml_flush` once `n` bytes are waiting (in the buffer or the codec),
+and `.flushMicroseconds = t` once `t` microseconds elapsed since the last
+flush (measured with `CTML_NOW()`, never with `CTML_NOLIBC` unless you define
+it). Both are checked when a tag is closed, so whole elements are sent.
+
+### Statistics
+
+When `CTML_STATS` is defined, every context counts what it does in `ctx->stats`
+(a `CTML_Stats`): bytes generated, sink calls, flushes, chars of text escaped and
+passed through, tags opened, nesting depth (and its max) and the time spent inside
+of the sink (in ns, measured with `CTML_STATS_NOW()`, `CTML_NOW()` by default,
+always 0 with `CTML_NOLIBC` unless you define it). A hook can be given to get them once `ctml()` is done:
+
+```c
+void log_stats(const CTML_Stats* stats, void* userData) {
+    printf("%llu bytes, %llu sink calls\n", (unsigned long long)stats->bytes,
+           (unsigned long long)stats->sinkCalls);
+}
+ctml(.write = sink, .onStats = log_stats) { ... }
+```
+
+Without `CTML_STATS`, nothing is counted and the fields do not exist.
+
+### ETags
+
+`.hash` takes a `CTML_Hash` fed with the HTML while it is flushed (XXH64,
+before the codec and the chunked encoding, so every output gives the same
+one). `ctml_etag` writes it as a strong ETag once `ctml()` is done. Rendered
+to an arena first, the body only has to be sent when it changed:
+
+```c
+CTML_Hash hash;
+char etag[CTML_ETAG_SIZE];
+ctml(.arena = &arena, .hash = &hash) { page(ctx); }
+ctml_etag(&hash, etag);
+if (if_none_match && strcmp(if_none_match, etag) == 0) {
+    send_status(client, 304, etag);
+} else {
+    send_page(client, etag, arena.data, arena.length);
+}
+```
+
+When the HTML is streamed, the ETag is only known at the end (for a trailer,
+or to answer the next requests).
+
 ## Usage
 
 The api of the library is really simple. It only consists of few
@@ -98,6 +260,11 @@ The first macro is `h(tag, attributes*)` that is used to created
 an HTML tag. You also have `hh(tag, attributes*)` to create self closed
 tags.
 
+Attribute values are escaped like `ctml_text`. String literals
+(`.class="box"`) are checked at compile time when optimizations are
+enabled (GCC/Clang): a literal without any char to escape is written
+as is, so only runtime values pay for the escaping.
+
 You'll also need the `ctml` macro that will create a context 
 containing the sink as well as the indentation state.
 
@@ -105,14 +272,45 @@ Two last 4 macros allow you to put text inside of the HTML.
 You can use `ctml_text(char* text)` to put some text in the
 HTML. This **will** be escaped by default. You can also use
 `ctml_textf(char* text, ...)` that accepts formating like
-printf and co.
+printf and co. Only the substituted strings and chars (`%s` and `%c`) are
+escaped, the format itself is trusted. Wide characters (`%ls`, `%lc`) are not
+supported: like unknown conversions, they are written as they are and the rest
+of the format is dropped.
 
 
 The last ones are `ctml_raw(char* text)` and `ctml_rawf(char* text, ...)`
 that works the same way than `ctml_text` except they do not do any escaping.
 **IMPORTANT**: ctml_raw(f) does NOT escape anything.
 
-Formatting macros depends on libc to work. (Using snprintf under the hood).
+Numbers can be written without going through printf, using `ctml_int(long long)`,
+`ctml_uint64(uint64_t)`, `ctml_int_grouped(long long, char separator)` (like `1,234,567`)
+and `ctml_double(double, int precision)`. `ctml_double` writes `precision` decimals
+(rounded like printf) or, with `CTML_SHORTEST`, the shortest text that reads back as
+the same double (like javascript does). Those do not depend on libc.
+
+Markup only made of literals can be built at compile time and written
+at once with `ctml_static`. `ctml_st(tag, attributes, children...)` and
+`ctml_sth(tag, attributes)` are the static versions of `h` and `hh`,
+`ctml_sa(name, "value")` is an attribute and `ctml_sraw("text")` is raw text:
+
+```c
+ctml_static(
+    ctml_st(head, ,
+        ctml_st(title, , ctml_sraw("CTML Server"))
+        ctml_sth(link, ctml_sa(rel, "stylesheet") ctml_sa(href, "style.css"))
+    )
+)
+```
+
+This generates the same HTML as the equivalent `h`/`hh`/`ctml_raw` calls.
+In pretty mode, the indentation (that depends on where the fragment is used)
+is added while the fragment is written.
+
+Formatting macros depends on libc to work. (Using vsnprintf under the hood).
+The text is formatted directly inside the buffer of the context, so they
+are thread safe and the formatted text has no length limit (text bigger than
+the buffer is formatted on the heap, using `CTML_MALLOC` and `CTML_FREE` that can
+be defined to use another allocator, along with `CTML_REALLOC` used by arenas).
 
 The only type you should care about is `CTML_Context` as explained
 in the [Components](#Components) section.
@@ -149,11 +347,31 @@ This library can be configured using some macros.
 `CTML_NOLIBC` will disable all libc dependent stuff (only
 the ctml_rawf macro)
 `CTML_CUSTOM_ATTRIBUTES` as explained in [Custom Attributes](#custom-attributes).
+`CTML_NO_SIMD` will disable the SSE2/AVX2 scanners used to find chars
+to escape on x86 (a table based scanner is used instead).
+`CTML_IOVEC` will enable the `.writev` sink (see [Scatter-gather output](#scatter-gather-output)).
+`CTML_STATS` will enable per context counters (see [Statistics](#statistics)).
 
 To avoid calling the sink loads of times, ctml will bufferize the output.
 The size of this buffer can be parametrized using `CTML_SINK_BUFSIZE`.
 The default value is 1024 bytes. Setting it to `1` or `0` will disable
-buffering.
+buffering. It can be lowered per context with `.bufferSize`
+(see [Flushing](#flushing)).
+
+A context can also be given its own buffer, sized at runtime (small for
+fragments, big for reports, or pre-faulted, huge page or registered memory):
+
+```c
+static char report_buffer[256 * 1024]; // Reused by every request
+ctml(.write = sink, .outputBuffer = report_buffer, .outputBufferSize = sizeof(report_buffer)) {
+    ...
+}
+```
+
+The buffer belongs to the caller (one byte of it is kept for the '\0' given
+to `.sink`) and can be reused once `ctml()` is done. The embedded buffer of
+`CTML_SINK_BUFSIZE` bytes is only used when there is none, so defining
+`CTML_SINK_BUFSIZE` to `1` makes contexts small when all of them get one.
 
 Those macros must be defined BEFORE including `ctml.h` and must be 
 repeated each time you inclde it (especially CTML_CUSTOM_ATTRIBUTES).
@@ -201,15 +419,249 @@ div(.id="truth") {
     }
 }
 ```
+
+## Fragment cache
+
+Components rendering the same HTML on every request (like a nav bar or
+a footer) can be cached by including `ctml_cache.h` (after `ctml.h`, it
+needs libc, C11 atomics and pthreads):
+
+```c
+ctml_cached("footer", 60) {
+    footer(.class="main") { ... }
+}
+```
+
+The first time, the block is rendered and the generated HTML is kept
+under the key (`"footer"`) for 60 seconds (0 means forever). Until then,
+the block is not run anymore and its HTML is copied at once instead.
+Lookups do not take any lock, so the cache can be shared by threads.
+
+`ctml_cached` uses `ctml_default_cache`, limited to `CTML_CACHE_MAX_BYTES`
+(16MB by default). Other caches can be created with
+`CTML_Cache cache = CTML_CACHE_INIT(max_bytes);` and used with
+`ctml_cached_in(&cache, key, ttl)`. When a cache is full, the least
+recently used fragments are evicted. Fragments can also be removed with
+`ctml_cache_invalidate(&cache, key)` or `ctml_cache_clear(&cache)`, and
+`ctml_cache_hits(&cache)` returns its number of hits (its `misses` and
+`evictions` counters can be read as well). A removed fragment is freed once
+no thread is copying it anymore, so the memory can briefly go over the limit
+(no fragment is stored while removed ones alone reach it).
+
+In pretty mode, the indentation is the one of the first render. Like `h()`,
+a cached block must not be left with `break`, `return` or `goto`.
+
+## Parallel rendering
+
+Independent parts of a page (like the panels of a dashboard) can be rendered
+by several threads by including `ctml_parallel.h` (after `ctml.h`, it needs
+libc, C11 atomics and pthreads). Each `ctml_task` of a `ctml_parallel` block
+calls a function with its own context:
+
+```c
+void render_panel(CTML_Context* ctx, void* arg) {
+    Panel* panel = arg;
+    section(.class="panel") { ... }
+}
+
+ctml_parallel {
+    h1() { ctml_text("Dashboard"); }
+    for (int i = 0; i < panel_count; i++) {
+        ctml_task(render_panel, &panels[i]);
+    }
+}
+```
+
+The tasks are rendered by a work-stealing thread pool, each in its own arena,
+while the block keeps going. What the block writes between the tasks is kept
+as well, and everything is spliced in document order at the end of the block:
+each task is written as soon as it and the ones before it are done, and what
+is ready is flushed before waiting, so the page keeps streaming. The waiting
+thread renders tasks too, and tasks can use `ctml_parallel` themselves.
+In pretty mode, tasks are indented like the place of the `ctml_task`.
+When the context has a `.tagHook` (like the ones of `ctml_live.h`) or a
+`.recorder` (see [Op-log](#op-log)), which need the tags in document order,
+tasks are rendered right away in the context instead. With `CTML_STATS`, the
+tags and text of the tasks are counted in the stats of the context.
+
+`ctml_task` must be used directly inside of the block (not in a function called
+from it), and `arg` must stay valid until the end of the block. Like `h()`,
+the block must not be left with `break`, `return` or `goto`.
+
+`ctml_parallel` uses `ctml_default_pool`, started on first use with
+`CTML_PARALLEL_THREADS` threads (0, the default, means one per core). Other
+pools can be started with `ctml_pool_init(&pool, threads)`, used with
+`ctml_parallel_in(&pool)` and stopped with `ctml_pool_destroy(&pool)`.
+Tasks are only worth it when they render a lot: each one costs an arena and
+a few allocations.
+
+## Incremental rendering
+
+Live views (htmx over SSE or websockets, for instance) can send only what changed
+since the last render by including `ctml_live.h` (after `ctml.h`, it needs libc).
+A `CTML_Live` is kept per client and `ctml_live` is used like `ctml()`:
+
+```c
+static CTML_Live view; // Zeroed, one per client
+ctml_live(&view, .write = sse_sink, .userData = client) {
+    dashboard(ctx);
+}
+```
+
+The page is rendered in an arena, and the elements with an `id` are tracked: their
+HTML is hashed (XXH64, see `ctml_hash`), their tracked children counting only by
+their id. The first render sends the whole page. The next ones only send the
+elements whose hash changed (the outermost ones, with their children) with a
+`hx-swap-oob="true"` attribute (`CTML_LIVE_OOB`), so the bandwidth depends on
+what changed instead of the size of the page. When something outside of the
+tracked elements changed, the whole page is sent again. `view.full` tells
+whether the last render was sent entirely, and `view.sent` how many elements
+it sent otherwise.
+
+Ids must be unique. Elements rendered by `ctml_task` or copied by `ctml_cached`
+are not tracked (they only are part of the HTML of their parent).
+`ctml_live_reset(&view)` makes the next render send the whole page (for a new
+connection), and `ctml_live_free(&view)` releases its memory. It relies on
+`.tagHook`, a `CTML_TagHook` told about every tag of a context.
+
+## Op-log
+
+`ctml_oplog.h` (included after `ctml.h`) records a rendering once, as a compact
+binary log of its tags, texts and raw output, which can be replayed later
+without running the template again. The log only contains bytes: it can be kept
+in a cache, written to a file, or replayed by another program.
+
+```c
+CTML_OpLog log = {0};
+ctml_record(&log) {
+    page(ctx);
+}
+// Later, as often as needed
+ctml(.write = sink) {
+    ctml_oplog_replay(ctx, log.arena.data, log.arena.length, CTML_OPLOG_MINIFIED);
+}
+```
+
+`CTML_OPLOG_COMPACT` gives the same HTML as rendering directly without
+`CTML_PRETTY`, `CTML_OPLOG_PRETTY` puts every tag on its own line (and the text
+between two tags on one line) and `CTML_OPLOG_MINIFIED` collapses the runs of
+whitespace of the texts. Texts are escaped when replayed. `ctml_oplog_next`
+iterates over the ops, for other serializers. Templates should be recorded
+without `CTML_PRETTY`: `ctml_static` fragments, tasks and cached fragments are
+recorded as raw output, as they are written. It relies on `.recorder`, a
+`CTML_Recorder` given the tags and texts of a context instead of their HTML.
+
+## io_uring output
+
+On Linux, `ctml_uring.h` writes the HTML through io_uring (raw syscalls, no
+liburing) so that rendering and I/O overlap: when the buffer is full it is
+submitted, and the template goes on right away in a second buffer instead of
+waiting for a blocking `send`. A `CTML_Uring` is kept per thread, with a pool
+of buffers (pre-faulted, and registered with the ring when `RLIMIT_MEMLOCK`
+allows it). Every response gets a `CTML_UringStream`:
+
+```c
+static _Thread_local CTML_Uring ring;
+ctml_uring_init(&ring, 64, 16 * 1024); // 64 buffers of 16 KB
+
+CTML_UringStream stream = {.ring = &ring, .fd = client_fd};
+ctml_uring(&stream, .chunked = 1) {
+    page(ctx);
+}
+ctml_uring_wait(&stream); // 0, or the errno of the write that failed
+```
+
+`ctml_uring` takes the same arguments as `ctml()` (but the sink) and returns
+once the last buffer is submitted. Instead of waiting, an event loop can give
+the stream a `done` callback and call `ctml_uring_reap(&ring, wait)` to handle
+completions. With `ring.batch = 1`, writes are only queued and the ones of
+every stream are submitted together by `ctml_uring_submit(&ring)` (or when a
+stream has to wait for a buffer). A stream has one write in flight at a time,
+so a render holds two buffers at most: the pool needs two per response being
+rendered at once. Output that is not in the buffer (codec output, the end of
+chunked responses) is copied to one. Short writes are resumed, and a write that
+finds the socket full (`EAGAIN`) is submitted again behind a poll for
+`POLLOUT`, so a slow client does not make the thread spin.
+
+## Background writer
+
+For slow sinks (files, pipes), `ctml_async.h` moves the writes to a thread
+of their own, so the rendering does not wait for every flush. A
+`CTML_AsyncWriter` owns the thread, the sink it calls and `depth` buffers:
+a full buffer is handed to the writer through a lock-free single producer,
+single consumer ring, and the rendering goes on in a free one. When all of
+them are waiting to be written, the rendering waits for the writer
+(backpressure).
+
+```c
+CTML_AsyncWriter writer;
+ctml_async_init(&writer, 8, 64 * 1024, file_sink, file); // 8 buffers of 64 KB
+
+ctml_async(&writer) {
+    report(ctx);
+}
+ctml_async_wait(&writer); // -1 if the sink failed
+fclose(file);
+ctml_async_free(&writer);
+```
+
+`ctml_async` takes the same arguments as `ctml()` (but the sink). The last
+buffer is handed to the writer at the end of the block, which does not wait
+for it: `ctml_async_wait` does (and clears the failure of the sink, which
+otherwise makes the next renderings fail). A writer can be kept for any
+number of renderings, made by one thread at a time. Output that is not in the
+buffer (codec output, the end of chunked responses) is copied to one.
 °°
 */
 #ifndef CTML_H
 #define CTML_H
 
+#include <stddef.h>
+#include <stdint.h>
+#ifndef CTML_NOLIBC
+	#include <string.h>
+	#include <stdarg.h>
+	#include <stdio.h>
+	#include <stdlib.h>
+
+	// Allocation functions used by ctml (only when libc is available)
+	#ifndef CTML_MALLOC
+		#define CTML_MALLOC(size) malloc(size)
+		#define CTML_REALLOC(ptr, size) realloc(ptr, size)
+		#define CTML_FREE(ptr) free(ptr)
+	#endif
+#endif
+#ifdef CTML_IOVEC
+	#include <sys/uio.h>
+#endif
+#ifndef CTML_NOLIBC
+	#include <time.h>
+#endif
+
 #ifndef CTML_CTX_NAME
 #define CTML_CTX_NAME ctx
 #endif
 
+#if defined(__GNUC__)
+	#define CTML_ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+	#define CTML_ALWAYS_INLINE static inline
+#endif
+
+// True for string literals, whose memory lives as long as the program.
+#if defined(__GNUC__)
+	#define CTML_IS_LITERAL(s) __builtin_constant_p(s)
+#else
+	#define CTML_IS_LITERAL(s) 0
+#endif
+
+// Lets the compiler check printf formats against their arguments.
+#if defined(__GNUC__)
+	#define CTML_PRINTF(format_index, first_argument) __attribute__((format(printf, format_index, first_argument)))
+#else
+	#define CTML_PRINTF(format_index, first_argument)
+#endif
+
 // This is the X macro containing attributes.
 // Instead of adding attributes here, they can
 // also be provided using the CTML_CUSTOM_ATTRIBUTES
@@ -223,34 +675,115 @@ div(.id="truth") {
 	X(src)   \
 
 
-/*CTML_Tag structure. Looks like this:
+/*CTML_TagAttributes structure. Looks like this:
 
 typedef struct {
-	char* tag_name;
-	int self_close;
+	const char* tag_name;
+	char self_close;
 
-	char* class;
-	char* id;
-	char* lang;
+	const char* class;
+	const char* id;
+	const char* lang;
 	... for all attributes and custom attributes.
-} CTML_Tag;
+} CTML_TagAttributes;
 
-Every call to h() or hh() macro ends up creating a tag. 
+Every call to h() or hh() macro fills one of those using designated initializers,
+and packs it into a CTML_Tag (see ctml_pack_tag).
 
 */
 typedef struct {
-	char* tag_name;
+	const char* tag_name;
 	char self_close;
-	#define X(field)     char* field;
-	#define XL(field, _) char* field;
+	#define X(field)     const char* field;
+	#define XL(field, _) const char* field;
+		ATTRIBUTES
+	#ifdef CTML_CUSTOM_ATTRIBUTES
+		CTML_CUSTOM_ATTRIBUTES
+	#endif
+	#undef X
+	#undef XL
+} CTML_TagAttributes;
+
+// Only used to give an index to every attribute: the offset
+// of a field is the index of the attribute with the same name.
+typedef struct {
+	#define X(field)     char field;
+	#define XL(field, _) char field;
 		ATTRIBUTES
 	#ifdef CTML_CUSTOM_ATTRIBUTES
 		CTML_CUSTOM_ATTRIBUTES
 	#endif
 	#undef X
 	#undef XL
+} CTML_AttributeIndex;
+
+#define CTML_ATTRIBUTE_INDEX(field) offsetof(CTML_AttributeIndex, field)
+#define CTML_ATTRIBUTE_COUNT sizeof(CTML_AttributeIndex)
+
+// Set on the index of an attribute in CTML_Tag when its value
+// has to be escaped.
+#define CTML_ATTRIBUTE_ESCAPE 0x8000
+
+// Attribute values are escaped, except string literals which are checked
+// at compile time: a literal without any char to escape is written as is.
+// The check only works once ctml_pack_tag is inlined and optimized, so
+// without optimizations (or GCC builtins) every value is escaped.
+#if defined(__GNUC__) && defined(__OPTIMIZE__)
+	#define CTML_ESCAPED_CHARS "<>&\"'"
+	#define CTML_IS_SAFE_LITERAL(value)                                      \
+		(__builtin_constant_p(__builtin_strlen(value))                   \
+		 && __builtin_constant_p(__builtin_strcspn(value, CTML_ESCAPED_CHARS)) \
+		 && __builtin_strcspn(value, CTML_ESCAPED_CHARS) == __builtin_strlen(value))
+#else
+	#define CTML_IS_SAFE_LITERAL(value) 0
+#endif
+
+/*
+ * CTML_Tag structure
+ * Compact version of CTML_TagAttributes only listing the attributes
+ * that were given, so that the cost of a tag does not depend
+ * on the number of attributes known by ctml.
+ * attributes and values are not initialized after count.
+ * CTML_ATTRIBUTE_ESCAPE is set in attributes for values that
+ * have to be escaped.
+*/
+typedef struct {
+	const char* tag_name;
+	size_t tag_name_length;
+	char self_close;
+	unsigned short count;
+	unsigned short attributes[CTML_ATTRIBUTE_COUNT];
+	const char* values[CTML_ATTRIBUTE_COUNT];
 } CTML_Tag;
 
+// Packs the attributes given to h() into tag.
+// This is inlined where h() is used and, as the attributes are known
+// there, the compiler only keeps the code for attributes that are given
+// and does not even build the CTML_TagAttributes. This is also where
+// literal values are found, see CTML_IS_SAFE_LITERAL.
+CTML_ALWAYS_INLINE void ctml_pack_tag(CTML_Tag* tag, size_t tag_name_length, const CTML_TagAttributes* attributes) {
+	unsigned short count = 0;
+	tag->tag_name = attributes->tag_name;
+	tag->tag_name_length = tag_name_length;
+	tag->self_close = attributes->self_close;
+	#define X(field)                                                        \
+		if (attributes->field != 0) {                                   \
+			tag->attributes[count] = CTML_ATTRIBUTE_INDEX(field)    \
+				| (CTML_IS_SAFE_LITERAL(attributes->field)      \
+				   ? 0 : CTML_ATTRIBUTE_ESCAPE);                \
+			tag->values[count] = attributes->field;                 \
+			count++;                                                \
+		}
+	#define XL(field, _) X(field)
+		ATTRIBUTES
+	#ifdef CTML_CUSTOM_ATTRIBUTES
+		CTML_CUSTOM_ATTRIBUTES
+	#endif
+	#undef X
+	#undef XL
+	tag->count = count;
+}
+
 
 /*
  * CTML_Context structure
@@ -258,19 +791,228 @@ typedef struct {
  * and the indent state for pretty printing the output if enabled.
 */
 
-// TODO: move tmpbuf here to be thread safe
-
 #ifndef CTML_SINK_BUFSIZE
 	#define CTML_SINK_BUFSIZE 1024
 #endif
 
-typedef void (*ctmlSink) (char*, void* userData);
+// Number of bytes of outputBuf that can hold HTML. The last byte
+// is kept for the '\0' handed to legacy ctmlSink functions.
+#define CTML_BUFFER_CAPACITY ((size_t)CTML_SINK_BUFSIZE - 1)
+
+// Arenas grow by at least that many bytes.
+#ifndef CTML_ARENA_CHUNK
+	#define CTML_ARENA_CHUNK (64 * 1024)
+#endif
+
+/*
+ * CTML_Arena structure
+ * Contiguous memory the HTML can be rendered to (see .arena).
+ * A zeroed arena is empty and ready to be used. Memory is kept
+ * by ctml_arena_reset, so reusing an arena does not allocate
+ * once it is big enough.
+*/
+typedef struct {
+	char* data; // The rendered HTML, '\0' terminated
+	size_t length;
+	size_t capacity;
+	size_t peak; // Biggest length reached since the arena was created
+	size_t allocations; // Number of times memory was (re)allocated
+	char failed; // Set when memory could not be allocated, the HTML is then truncated
+} CTML_Arena;
+
+int ctml_arena_reserve(CTML_Arena* arena, size_t capacity);
+void ctml_arena_reset(CTML_Arena* arena);
+void ctml_arena_free(CTML_Arena* arena);
+
+/*
+ * CTML_Hash structure
+ * Streaming XXH64, to hash generated HTML while it is
+ * produced (see .hash and ctml_live.h).
+*/
 typedef struct {
+	uint64_t total;
+	uint64_t v[4];
+	unsigned char memory[32]; // Last incomplete stripe
+	size_t memorySize;
+	uint64_t seed;
+} CTML_Hash;
+
+void ctml_hash_reset(CTML_Hash* hash, uint64_t seed);
+void ctml_hash_update(CTML_Hash* hash, const void* data, size_t length);
+uint64_t ctml_hash_digest(const CTML_Hash* hash);
+uint64_t ctml_hash(const void* data, size_t length, uint64_t seed);
+
+// Size of an ETag written by ctml_etag, with its '\0'.
+#define CTML_ETAG_SIZE 19
+
+void ctml_etag(const CTML_Hash* hash, char etag[CTML_ETAG_SIZE]);
+
+#ifdef CTML_IOVEC
+	// Maximum number of iovec entries sent at once (at least 3).
+	#ifndef CTML_IOVEC_MAX
+		#define CTML_IOVEC_MAX 64
+	#endif
+	// String literals at least that long are referenced instead of copied.
+	#ifndef CTML_IOVEC_MIN_REF
+		#define CTML_IOVEC_MIN_REF 64
+	#endif
+#endif
+
+#ifdef CTML_STATS
+	/*
+	 * CTML_Stats structure
+	 * Counters of a context, only available with CTML_STATS.
+	*/
+	typedef struct {
+		uint64_t bytes; // Bytes of HTML generated
+		uint64_t sinkCalls;
+		uint64_t flushes; // Number of times buffered HTML was sent
+		uint64_t bytesEscaped; // Chars of text replaced by an entity
+		uint64_t bytesPassedThrough; // Chars of text that did not need to be
+		uint64_t tags; // Tags opened
+		int depth;
+		int maxDepth;
+		uint64_t sinkNanoseconds; // Time spent inside of the sink
+	} CTML_Stats;
+
+	// Called with the counters once ctml() is done.
+	typedef void (*ctmlStatsHook) (const CTML_Stats* stats, void* userData);
+
+	// Clock used to measure the time spent in the sink, in nanoseconds.
+	#ifndef CTML_STATS_NOW
+		#define CTML_STATS_NOW() CTML_NOW()
+	#endif
+
+	#define CTML_STATS_ADD(field, value) (CTML_CTX_NAME->stats.field += (value))
+#else
+	#define CTML_STATS_ADD(field, value) ((void)0)
+#endif
+
+// Monotonic clock in nanoseconds, used by the statistics and the
+// time based auto-flush.
+#ifndef CTML_NOW
+	#ifdef CTML_NOLIBC
+		#define CTML_NOW() 0
+	#else
+		#define CTML_NOW() ctml_now()
+	#endif
+#endif
+
+struct CTML_Context;
+
+// What a codec is asked to do with the data it is given.
+enum {
+	CTML_CODEC_WRITE, // Data flushed from the buffer
+	CTML_CODEC_FLUSH, // Everything given so far must reach the sink
+	CTML_CODEC_FINISH, // End of the rendering (no data), be ready for the next one
+};
+
+/*
+ * CTML_Codec structure
+ * Optional stage between the buffer and the sink transforming the HTML,
+ * like compressing it (see ctml_deflate.h). Codecs embed it as their
+ * first member and send their output with ctml_codec_output.
+*/
+typedef struct CTML_Codec {
+	// Returns 0, or anything else when it failed.
+	int (*encode) (struct CTML_Codec* codec, struct CTML_Context* ctx, const char* data, size_t length, int mode);
+} CTML_Codec;
+
+/*
+ * CTML_TagHook structure
+ * Optional observer of the tags of a context (see ctml_live.h), embedded
+ * as the first member of its state like CTML_Codec. open is called before
+ * a tag is written (after its indentation), close right after it is closed,
+ * or right after it is written for self closing tags.
+*/
+typedef struct CTML_TagHook {
+	void (*open) (struct CTML_TagHook* hook, struct CTML_Context* ctx, const CTML_Tag* tag);
+	void (*close) (struct CTML_TagHook* hook, struct CTML_Context* ctx, const CTML_Tag* tag);
+} CTML_TagHook;
+
+/*
+ * CTML_Recorder structure
+ * When a context has one (see ctml_oplog.h), tags and text to escape are
+ * given to it instead of being written, and the pretty printing is left
+ * out. Raw output is still written to the buffer.
+*/
+typedef struct CTML_Recorder {
+	void (*open) (struct CTML_Recorder* recorder, struct CTML_Context* ctx, const CTML_Tag* tag);
+	void (*close) (struct CTML_Recorder* recorder, struct CTML_Context* ctx, const CTML_Tag* tag);
+	void (*text) (struct CTML_Recorder* recorder, struct CTML_Context* ctx, const char* text, size_t length);
+} CTML_Recorder;
+
+// Legacy sink, receives '\0' terminated chunks.
+typedef void (*ctmlSink) (char*, void* userData);
+// Length-aware sink, receives chunks that are NOT '\0' terminated.
+// When both are given, .write is used. Returns 0, or anything else
+// when it failed (the rendering is then stopped, see ctx->failed).
+typedef int (*ctmlWriteSink) (const char* data, size_t length, void* userData);
+#ifdef CTML_IOVEC
+	// Scatter-gather sink, receives batches of chunks (ready for writev).
+	// Used over the other sinks when given.
+	typedef int (*ctmlWritevSink) (const struct iovec* iov, int count, void* userData);
+#endif
+typedef struct CTML_Context {
 	ctmlSink sink;	
+	ctmlWriteSink write;
+	#ifdef CTML_IOVEC
+		ctmlWritevSink writev;
+	#endif
 	void* userData;
+	// When given, the HTML is rendered in the arena (after what
+	// it already contains) instead of being sent to a sink.
+	CTML_Arena* arena;
+	// Sends the HTML with the HTTP/1.1 chunked transfer encoding.
+	int chunked;
+	// Transforms the HTML before it reaches the sink (and the chunked encoding).
+	CTML_Codec* codec;
+	// Told about every tag.
+	CTML_TagHook* tagHook;
+	// Records tags and text instead of writing them.
+	CTML_Recorder* recorder;
+	// Hashes the HTML as it is flushed (before the codec and the
+	// chunked encoding), reset by ctml_begin. See ctml_etag.
+	CTML_Hash* hash;
+	// Buffer used instead of outputBuf when set, of outputBufferSize bytes
+	// (one is kept for the '\0'). It belongs to the caller, and can be
+	// reused once ctml_end returned.
+	char* outputBuffer;
+	size_t outputBufferSize;
+	// Bytes buffered before they are sent, 0 means the size of the
+	// buffer minus one (it cannot be more). Lower it to send the first
+	// bytes earlier.
+	size_t bufferSize;
+	// Auto-flush policy, checked when tags are closed: ctml_flush is
+	// called once flushBytes bytes are waiting or flushMicroseconds
+	// elapsed since the last flush. 0 disables them.
+	size_t flushBytes;
+	uint32_t flushMicroseconds;
+	// Set when the sink failed. Everything written after is dropped
+	// and the content of the tags is not rendered anymore.
+	int failed;
 	int indent;
+	// Where the HTML is buffered: outputBuffer, outputBuf, or the arena.
+	// Set by ctml_begin.
+	char* buffer;
+	size_t bufferCapacity;
 	char outputBuf[CTML_SINK_BUFSIZE];
-	int bufferedDataLength;
+	size_t bufferedDataLength;
+	// Bytes given to the codec since the last ctml_flush.
+	size_t unflushedBytes;
+	uint64_t lastFlush;
+	#ifdef CTML_IOVEC
+		// Batch sent to .writev: literals and pieces of the buffer
+		// (and the chunk header and end with .chunked).
+		struct iovec iov[CTML_IOVEC_MAX + 2];
+		int iovCount;
+		// Start of the buffered data that is not in iov yet.
+		size_t iovBufferStart;
+	#endif
+	#ifdef CTML_STATS
+		CTML_Stats stats;
+		ctmlStatsHook onStats;
+	#endif
 } CTML_Context;
 
 
@@ -278,8 +1020,81 @@ typedef struct {
 	void ctml_indent(CTML_Context* CTML_CTX_NAME, int indent);
 #endif
 
-void ctml_open_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
+int ctml_open_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
 void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
+void ctml_escape_text(CTML_Context* CTML_CTX_NAME, const char* text);
+void ctml_escape_textn(CTML_Context* CTML_CTX_NAME, const char* text, size_t length);
+void ctml_begin(CTML_Context* CTML_CTX_NAME);
+void ctml_flush_buffer(CTML_Context* CTML_CTX_NAME);
+void ctml_flush(CTML_Context* CTML_CTX_NAME);
+void ctml_end(CTML_Context* CTML_CTX_NAME);
+void ctml_codec_output(CTML_Context* CTML_CTX_NAME, const char* data, size_t length);
+void ctml_write_slow(CTML_Context* CTML_CTX_NAME, const char* data, size_t length);
+#ifdef CTML_IOVEC
+	void ctml_write_iov(CTML_Context* CTML_CTX_NAME, const char* data, size_t length);
+#endif
+void ctml_spaces(CTML_Context* CTML_CTX_NAME, int count);
+void ctml_buffered_ctml_output(CTML_Context* CTML_CTX_NAME, char* data, int length);
+
+#ifdef CTML_NOLIBC
+	static inline void ctml_memcpy(char* dst, const char* src, size_t length) {
+		while (length--) *dst++ = *src++;
+	}
+	static inline size_t ctml_strlen(const char* str) {
+		size_t length = 0;
+		while (str[length] != '\0') length++;
+		return length;
+	}
+#else
+	#define ctml_memcpy memcpy
+	#define ctml_strlen strlen
+#endif
+
+// ctml_write is the output core: every byte of HTML goes through it.
+// The common case (the data fits in the remaining buffer) is a single
+// memcpy and is inlined at every call site. Everything else (flushing,
+// writes bigger than the buffer, unbuffered mode) is handled by ctml_write_slow.
+static inline void ctml_write(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	size_t used = CTML_CTX_NAME->bufferedDataLength;
+	if (length <= CTML_CTX_NAME->bufferCapacity - used) {
+		ctml_memcpy(CTML_CTX_NAME->buffer + used, data, length);
+		CTML_CTX_NAME->bufferedDataLength = used + length;
+		return;
+	}
+	ctml_write_slow(CTML_CTX_NAME, data, length);
+}
+
+// ctml_write for data living until the end of the rendering (string literals).
+// With CTML_IOVEC and a .writev sink, big ones are referenced instead of copied.
+static inline void ctml_write_static(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	#ifdef CTML_IOVEC
+		if (length >= CTML_IOVEC_MIN_REF && CTML_CTX_NAME->writev && !CTML_CTX_NAME->arena && !CTML_CTX_NAME->codec) {
+			ctml_write_iov(CTML_CTX_NAME, data, length);
+			return;
+		}
+	#endif
+	ctml_write(CTML_CTX_NAME, data, length);
+}
+
+#ifdef CTML_PRETTY
+	// Ends the line of a text in pretty mode (left out when recording).
+	static inline void ctml_newline(CTML_Context* CTML_CTX_NAME) {
+		if (!CTML_CTX_NAME->recorder) {
+			ctml_write_static(CTML_CTX_NAME, "\n", 1);
+		}
+	}
+#endif
+
+// ctml_output is used for '\0' terminated strings. ctml_output_lit
+// is used for string literals as their length is known at compile time.
+// ctml_output_raw is ctml_output, noticing when c is a string literal.
+#define ctml_output(c) ctml_write(CTML_CTX_NAME, c, ctml_strlen(c));
+#define ctml_output_lit(c) ctml_write_static(CTML_CTX_NAME, c, sizeof(c) - 1);
+#ifdef CTML_IOVEC
+	#define ctml_output_raw(c) if (CTML_IS_LITERAL(c)) { ctml_write_static(CTML_CTX_NAME, c, ctml_strlen(c)); } else { ctml_output(c) }
+#else
+	#define ctml_output_raw(c) ctml_output(c)
+#endif
 
 // Those CONCAT macros are used to generate unique names for created tag
 // like this: __tag__32 with 32 the __LINE__ number where h() or hh() macros
@@ -289,10 +1104,11 @@ void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
 
 // ctml_tag is THE macro of the library using the for() trick.
 // basically it does 3 things
-// 1. Create a CTML_Tag
+// 1. Create a CTML_Tag (packed from the given attributes)
 // 2. Call ctml_open_tag() to generate the opening of it (like <div class="toto"> )
 // 3. Start a for loop that will be executed once and then call ctml_close_tag to generate
-//    the closing tag. (like <div/>)
+//    the closing tag. (like <div/>). ctml_open_tag is called in its init so
+//    the loop is not executed at all once the sink failed.
 // NOTE: The for loop does not have brackets, because the inside of the tag will be defined inside the
 // user code like this
 //
@@ -304,9 +1120,9 @@ void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
 // } <-- END OF FOR LOOP - will call ctml_close_tag for the dib
 // 
 #define ctml_tag(n, ...)                                               \
-	CTML_Tag CONCAT(_tag_, __LINE__) = {.tag_name=#n, __VA_ARGS__};			\
-	ctml_open_tag(CTML_CTX_NAME, &CONCAT(_tag_, __LINE__));                                         \
-	for (int _once = 0; _once < 1; _once=1,ctml_close_tag(CTML_CTX_NAME, &CONCAT(_tag_, __LINE__))) \
+	CTML_Tag CONCAT(_tag_, __LINE__);                                                                     \
+	ctml_pack_tag(&CONCAT(_tag_, __LINE__), sizeof(#n) - 1, &(CTML_TagAttributes){.tag_name=#n, __VA_ARGS__}); \
+	for (int _once = ctml_open_tag(CTML_CTX_NAME, &CONCAT(_tag_, __LINE__)); _once < 1; _once=1,ctml_close_tag(CTML_CTX_NAME, &CONCAT(_tag_, __LINE__))) \
 
 
 // Those macros are used by the user.
@@ -318,37 +1134,101 @@ void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
 // TODO: Maybe find a way not to have this "hidden" CTML_CTX_NAME the user can use ?
 #define ctml(...) CTML_Context ctml_context = (CTML_Context) {__VA_ARGS__}; \
 		  CTML_Context* CTML_CTX_NAME = &ctml_context; \
-		  for (int _once = 0; _once < 1; _once=1,ctml_flush_buffer(CTML_CTX_NAME)) \
+		  ctml_begin(CTML_CTX_NAME); \
+		  for (int _once = 0; _once < 1; _once=1,ctml_end(CTML_CTX_NAME)) \
 
 
 // Definition of ctml_raw macro.
 #ifdef CTML_PRETTY
-	#define ctml_raw(t) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_output(t);ctml_output("\n");
-	#define ctml_text(t) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_escape_text(CTML_CTX_NAME, t);ctml_output("\n");
+	#define ctml_raw(t) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_output_raw(t);ctml_newline(CTML_CTX_NAME);
+	#define ctml_text(t) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_escape_text(CTML_CTX_NAME, t);ctml_newline(CTML_CTX_NAME);
 #else
-	#define ctml_raw(t) ctml_output(t);
+	#define ctml_raw(t) ctml_output_raw(t);
 	#define ctml_text(t) ctml_escape_text(CTML_CTX_NAME, t);
 #endif // CTML_PRETTY
 
+// Static fragments: markup only made of literals, built by the preprocessor
+// as a single string literal and written with a single ctml_write.
+// ctml_st and ctml_sth are the static versions of h and hh, ctml_sa is an
+// attribute and ctml_sraw some raw text. For instance:
+//
+// ctml_static(
+// 	ctml_st(head, ,
+// 		ctml_st(title, , ctml_sraw("CTML Server"))
+// 		ctml_sth(link, ctml_sa(rel, "stylesheet") ctml_sa(href, "style.css"))
+// 	)
+// )
+//
+// In pretty mode, the fragment holds markers instead of the indentation, which
+// depends on where it is used, and ctml_write_static_pretty indents it.
+#define ctml_sa(name, value) " " #name "=\"" value "\""
+#ifdef CTML_PRETTY
+	// Indentation of a line, and indentation level going up and down.
+	#define CTML_STATIC_INDENT "\x01"
+	#define CTML_STATIC_IN "\x02"
+	#define CTML_STATIC_OUT "\x03"
+
+	#define ctml_st(n, attributes, ...) \
+		CTML_STATIC_INDENT "<" #n attributes ">\n" CTML_STATIC_IN __VA_ARGS__ CTML_STATIC_OUT CTML_STATIC_INDENT "</" #n ">\n"
+	#define ctml_sth(n, attributes) CTML_STATIC_INDENT "<" #n attributes "/>\n"
+	#define ctml_sraw(t) CTML_STATIC_INDENT t "\n"
+
+	void ctml_write_static_pretty(CTML_Context* CTML_CTX_NAME, const char* fragment, size_t length);
+	#define ctml_static(fragment) ctml_write_static_pretty(CTML_CTX_NAME, fragment, sizeof(fragment) - 1);
+#else
+	#define ctml_st(n, attributes, ...) "<" #n attributes ">" __VA_ARGS__ "</" #n ">"
+	#define ctml_sth(n, attributes) "<" #n attributes "/>"
+	#define ctml_sraw(t) t
+
+	#define ctml_static(fragment) ctml_output_lit(fragment)
+#endif // CTML_PRETTY
+
 // Implementation of ctml_rawf that is basically
-// just a snprintf inside a temp buffer.
-// The size of the buffer can be changed using the
-// macro CTML_BUF_SIZE (default: 1024 bytes)
-// TODO: What happens if the buffer is too small. A warning might be printed.
+// just a vsnprintf directly inside the free space of the context
+// buffer, so it is thread safe and does not copy the formatted text.
+// Results that do not fit in the buffer are formatted on the heap.
 #ifndef CTML_NOLIBC
 
-	#ifndef CTML_BUF_SIZE
-		#define CTML_BUF_SIZE 1024
-	#endif
+	void ctml_format(CTML_Context* CTML_CTX_NAME, const char* format, ...) CTML_PRINTF(2, 3);
+	void ctml_vformat(CTML_Context* CTML_CTX_NAME, const char* format, va_list args) CTML_PRINTF(2, 0);
+	void ctml_escape_format(CTML_Context* CTML_CTX_NAME, const char* format, ...) CTML_PRINTF(2, 3);
+	void ctml_escape_vformat(CTML_Context* CTML_CTX_NAME, const char* format, va_list args) CTML_PRINTF(2, 0);
 
-	char ctml_tmpbuf[CTML_BUF_SIZE];
+	// ctml_textf only escapes what is substituted in the format (%s and %c).
+	// The format itself is trusted and sent as it is.
+	#ifdef CTML_PRETTY
+		#define ctml_rawf(...) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_format(CTML_CTX_NAME, __VA_ARGS__);ctml_newline(CTML_CTX_NAME);
+		#define ctml_textf(...) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_escape_format(CTML_CTX_NAME, __VA_ARGS__);ctml_newline(CTML_CTX_NAME);
+	#else
+		#define ctml_rawf(...) ctml_format(CTML_CTX_NAME, __VA_ARGS__);
+		#define ctml_textf(...) ctml_escape_format(CTML_CTX_NAME, __VA_ARGS__);
+	#endif // CTML_PRETTY
 
-	#define ctml_rawf(...)                                     \
-		snprintf(ctml_tmpbuf, CTML_BUF_SIZE, __VA_ARGS__);  \
-		ctml_raw(ctml_tmpbuf);
+#endif // CTML_NOLIBC
 
+// Numbers are written directly inside the context buffer, without
+// going through printf (so they are also available with CTML_NOLIBC).
+// ctml_double takes the number of decimals to write, or CTML_SHORTEST
+// for the shortest text that reads back as the same double.
+// ctml_int_grouped writes a separator between groups of 3 digits (1,234,567).
+#define CTML_SHORTEST -1
 
-#endif // CTML_NOLIBC
+void ctml_write_int(CTML_Context* CTML_CTX_NAME, long long value);
+void ctml_write_uint64(CTML_Context* CTML_CTX_NAME, uint64_t value);
+void ctml_write_int_grouped(CTML_Context* CTML_CTX_NAME, long long value, char separator);
+void ctml_write_double(CTML_Context* CTML_CTX_NAME, double value, int precision);
+
+#ifdef CTML_PRETTY
+	#define ctml_int(v) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_write_int(CTML_CTX_NAME, v);ctml_newline(CTML_CTX_NAME);
+	#define ctml_uint64(v) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_write_uint64(CTML_CTX_NAME, v);ctml_newline(CTML_CTX_NAME);
+	#define ctml_int_grouped(v, separator) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_write_int_grouped(CTML_CTX_NAME, v, separator);ctml_newline(CTML_CTX_NAME);
+	#define ctml_double(v, precision) ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);ctml_write_double(CTML_CTX_NAME, v, precision);ctml_newline(CTML_CTX_NAME);
+#else
+	#define ctml_int(v) ctml_write_int(CTML_CTX_NAME, v);
+	#define ctml_uint64(v) ctml_write_uint64(CTML_CTX_NAME, v);
+	#define ctml_int_grouped(v, separator) ctml_write_int_grouped(CTML_CTX_NAME, v, separator);
+	#define ctml_double(v, precision) ctml_write_double(CTML_CTX_NAME, v, precision);
+#endif // CTML_PRETTY
 
 
 
@@ -356,150 +1236,1634 @@ void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag);
 
 #ifdef CTML_IMPLEMENTATION
 
-#define ctml_output(c) ctml_buffered_ctml_output(CTML_CTX_NAME, c, -1);
+#ifndef CTML_NOLIBC
+	static uint64_t ctml_now(void) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+#endif
 
-void ctml_buffered_ctml_output(CTML_Context* CTML_CTX_NAME, char* data, int length) {
-	#if CTML_SINK_BUFSIZE == 0 || CTML_SINK_BUFSIZE == 1
-		CTML_CTX_NAME->sink(data, CTML_CTX_NAME->userData);
-	#else
-		int available = CTML_SINK_BUFSIZE - CTML_CTX_NAME->bufferedDataLength - 1;
-		int i;
-		for (i = 0; i < available; i++) {
-			if (data[i] == '\0' || (i == length && length != -1) ) {
-				break;
-			}
-			(CTML_CTX_NAME->outputBuf+CTML_CTX_NAME->bufferedDataLength)[i] = data[i];
-		}
-		CTML_CTX_NAME->bufferedDataLength += i;
-		// Check if the buffer is full
-		if (i == available) {
-			CTML_CTX_NAME->outputBuf[CTML_SINK_BUFSIZE-1] = '\0';
-			CTML_CTX_NAME->sink(CTML_CTX_NAME->outputBuf, CTML_CTX_NAME->userData);
+// Called when the sink failed: the buffer is dropped and, as it has no
+// capacity anymore, every write ends up in ctml_write_slow which ignores it.
+static void ctml_fail(CTML_Context* CTML_CTX_NAME) {
+	CTML_CTX_NAME->failed = 1;
+	CTML_CTX_NAME->bufferCapacity = 0;
+	CTML_CTX_NAME->bufferedDataLength = 0;
+	#ifdef CTML_IOVEC
+		CTML_CTX_NAME->iovCount = 0;
+		CTML_CTX_NAME->iovBufferStart = 0;
+	#endif
+}
 
-			CTML_CTX_NAME->bufferedDataLength = 0;
-		}
-		// if there is data left
-		if (data[i] != '\0') {
-			// send the rest of it
-			int new_length = length;
-			if (length != -1) {
-				new_length -= i;
-			}
-			if (new_length != 0) {
-				ctml_buffered_ctml_output(CTML_CTX_NAME, data+i, new_length);
+static void ctml_sink_call(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	if (CTML_CTX_NAME->failed) return;
+	#ifdef CTML_IOVEC
+		if (CTML_CTX_NAME->writev) {
+			struct iovec iov = {(void*)data, length};
+			CTML_STATS_ADD(sinkCalls, 1);
+			if (CTML_CTX_NAME->writev(&iov, 1, CTML_CTX_NAME->userData) != 0) {
+				ctml_fail(CTML_CTX_NAME);
 			}
+			return;
 		}
 	#endif
+	if (CTML_CTX_NAME->write) {
+		CTML_STATS_ADD(sinkCalls, 1);
+		if (CTML_CTX_NAME->write(data, length, CTML_CTX_NAME->userData) != 0) {
+			ctml_fail(CTML_CTX_NAME);
+		}
+		return;
+	}
+	if (data == CTML_CTX_NAME->buffer) {
+		CTML_CTX_NAME->buffer[length] = '\0';
+		CTML_STATS_ADD(sinkCalls, 1);
+		CTML_CTX_NAME->sink(CTML_CTX_NAME->buffer, CTML_CTX_NAME->userData);
+		return;
+	}
+	// Legacy sinks need '\0' terminated strings, so data that
+	// does not come from the buffer is sent through a small copy.
+	char chunk[64];
+	while (length > 0) {
+		size_t n = length < sizeof(chunk) - 1 ? length : sizeof(chunk) - 1;
+		ctml_memcpy(chunk, data, n);
+		chunk[n] = '\0';
+		CTML_STATS_ADD(sinkCalls, 1);
+		CTML_CTX_NAME->sink(chunk, CTML_CTX_NAME->userData);
+		data += n;
+		length -= n;
+	}
 }
 
-void ctml_flush_buffer(CTML_Context* CTML_CTX_NAME) {
-	if (CTML_CTX_NAME->bufferedDataLength != 0) {
-		CTML_CTX_NAME->outputBuf[CTML_CTX_NAME->bufferedDataLength] = '\0';
-		CTML_CTX_NAME->sink(CTML_CTX_NAME->outputBuf, CTML_CTX_NAME->userData);
-		CTML_CTX_NAME->bufferedDataLength = 0;
-	}
+// Sends data to the user sink, whatever its kind is.
+static void ctml_sink_send(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	#ifdef CTML_STATS
+		uint64_t start = CTML_STATS_NOW();
+		CTML_STATS_ADD(bytes, length);
+	#endif
+	ctml_sink_call(CTML_CTX_NAME, data, length);
+	#ifdef CTML_STATS
+		CTML_STATS_ADD(sinkNanoseconds, CTML_STATS_NOW() - start);
+	#endif
 }
 
+// Room kept in front of the buffer for the header of a chunk
+// (its length in hex and CRLF), and after it for the CRLF ending it.
+#define CTML_CHUNK_HEADER 10
+#define CTML_CHUNK_OVERHEAD (CTML_CHUNK_HEADER + 2)
 
+// Start of the memory buffering the HTML of a context without arena.
+static char* ctml_buffer_start(CTML_Context* CTML_CTX_NAME) {
+	return CTML_CTX_NAME->outputBuffer ? CTML_CTX_NAME->outputBuffer : CTML_CTX_NAME->outputBuf;
+}
 
-#ifdef CTML_PRETTY
-	void ctml_indent(CTML_Context* CTML_CTX_NAME, int count) {
-		for (int i = 0; i < count; i++) {
-			ctml_output(" ");
-		}
+// Writes the header of a chunk of length bytes so that it ends
+// right before end. Returns its length.
+static size_t ctml_chunk_header(char* end, size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	char* start = end - 2;
+	start[0] = '\r';
+	start[1] = '\n';
+	do {
+		*--start = digits[length & 15];
+		length >>= 4;
+	} while (length != 0);
+	return end - start;
+}
+
+// Sends data to the user sink, as one chunk when .chunked is set.
+// This is where codecs send what they produce.
+void ctml_codec_output(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	if (!CTML_CTX_NAME->chunked) {
+		ctml_sink_send(CTML_CTX_NAME, data, length);
+		return;
 	}
-#endif // CTML_PRETTY
+	// An empty chunk would end the response.
+	if (length == 0) return;
+	if (data == CTML_CTX_NAME->buffer && CTML_CTX_NAME->buffer != ctml_buffer_start(CTML_CTX_NAME)) {
+		// The buffer has room around it (see ctml_begin), so
+		// the chunk is sent with a single call.
+		size_t header = ctml_chunk_header(CTML_CTX_NAME->buffer, length);
+		CTML_CTX_NAME->buffer[length] = '\r';
+		CTML_CTX_NAME->buffer[length + 1] = '\n';
+		ctml_sink_send(CTML_CTX_NAME, data - header, header + length + 2);
+		return;
+	}
+	char header[2 * sizeof(size_t) + 2];
+	size_t header_length = ctml_chunk_header(header + sizeof(header), length);
+	ctml_sink_send(CTML_CTX_NAME, header + sizeof(header) - header_length, header_length);
+	ctml_sink_send(CTML_CTX_NAME, data, length);
+	ctml_sink_send(CTML_CTX_NAME, "\r\n", 2);
+}
 
-void ctml_open_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag) {
-	#ifdef CTML_PRETTY
-		ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);
+// Sends data to the user sink, through the codec if there is one.
+static void ctml_sink_write(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	CTML_Codec* codec = CTML_CTX_NAME->codec;
+	if (CTML_CTX_NAME->hash) {
+		ctml_hash_update(CTML_CTX_NAME->hash, data, length);
+	}
+	if (codec) {
+		CTML_CTX_NAME->unflushedBytes += length;
+		if (!CTML_CTX_NAME->failed && codec->encode(codec, CTML_CTX_NAME, data, length, CTML_CODEC_WRITE) != 0) {
+			ctml_fail(CTML_CTX_NAME);
+		}
+		return;
+	}
+	ctml_codec_output(CTML_CTX_NAME, data, length);
+}
+
+// Makes the arena of the context big enough for size more bytes.
+static int ctml_arena_grow(CTML_Context* CTML_CTX_NAME, size_t size) {
+	CTML_Arena* arena = CTML_CTX_NAME->arena;
+	// One more byte for the '\0' written by ctml_flush_buffer.
+	if (!ctml_arena_reserve(arena, CTML_CTX_NAME->bufferedDataLength + size + 1)) {
+		return 0;
+	}
+	CTML_CTX_NAME->buffer = arena->data;
+	CTML_CTX_NAME->bufferCapacity = arena->capacity - 1;
+	return 1;
+}
+
+// Returns where size bytes can be written in the buffer, after flushing
+// it or growing the arena if needed. NULL if the buffer is too small.
+static char* ctml_reserve(CTML_Context* CTML_CTX_NAME, size_t size) {
+	if (CTML_CTX_NAME->bufferCapacity - CTML_CTX_NAME->bufferedDataLength < size) {
+		if (CTML_CTX_NAME->arena) {
+			if (!ctml_arena_grow(CTML_CTX_NAME, size)) return NULL;
+		} else {
+			ctml_flush_buffer(CTML_CTX_NAME);
+			if (CTML_CTX_NAME->bufferCapacity < size) return NULL;
+		}
+	}
+	return CTML_CTX_NAME->buffer + CTML_CTX_NAME->bufferedDataLength;
+}
+
+void ctml_write_slow(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+	if (CTML_CTX_NAME->failed) return;
+	if (CTML_CTX_NAME->arena) {
+		char* dst = ctml_reserve(CTML_CTX_NAME, length);
+		if (dst != NULL) {
+			ctml_memcpy(dst, data, length);
+			CTML_CTX_NAME->bufferedDataLength += length;
+		}
+		return;
+	}
+	#ifdef CTML_IOVEC
+		// Big writes are sent along with the current batch.
+		if (CTML_CTX_NAME->writev && !CTML_CTX_NAME->codec && length >= CTML_CTX_NAME->bufferCapacity && length > 0) {
+			ctml_write_iov(CTML_CTX_NAME, data, length);
+			ctml_flush_buffer(CTML_CTX_NAME);
+			return;
+		}
+	#endif
+	// Big writes skip the buffer entirely as copying
+	// them would only split them in smaller sink calls.
+	// Without buffer, everything is sent as it comes.
+	if ((CTML_CTX_NAME->write && length >= CTML_CTX_NAME->bufferCapacity) || CTML_CTX_NAME->bufferCapacity == 0) {
+		ctml_flush_buffer(CTML_CTX_NAME);
+		ctml_sink_write(CTML_CTX_NAME, data, length);
+		return;
+	}
+	while (length > 0) {
+		size_t used = CTML_CTX_NAME->bufferedDataLength;
+		size_t n = CTML_CTX_NAME->bufferCapacity - used;
+		if (n > length) {
+			n = length;
+		}
+		ctml_memcpy(CTML_CTX_NAME->buffer + used, data, n);
+		CTML_CTX_NAME->bufferedDataLength = used + n;
+		data += n;
+		length -= n;
+		// Check if the buffer is full
+		if (CTML_CTX_NAME->bufferedDataLength == CTML_CTX_NAME->bufferCapacity) {
+			ctml_flush_buffer(CTML_CTX_NAME);
+			if (CTML_CTX_NAME->failed) return;
+		}
+	}
+}
+
+#ifdef CTML_IOVEC
+	// Adds what was buffered since the last iovec entry to the batch.
+	static void ctml_iov_add_buffer(CTML_Context* CTML_CTX_NAME) {
+		size_t start = CTML_CTX_NAME->iovBufferStart;
+		if (CTML_CTX_NAME->bufferedDataLength > start) {
+			struct iovec* iov = &CTML_CTX_NAME->iov[CTML_CTX_NAME->iovCount++];
+			iov->iov_base = CTML_CTX_NAME->buffer + start;
+			iov->iov_len = CTML_CTX_NAME->bufferedDataLength - start;
+			CTML_CTX_NAME->iovBufferStart = CTML_CTX_NAME->bufferedDataLength;
+		}
+	}
+
+	// Adds data to the batch without copying it, so it must stay
+	// valid until the buffer is flushed.
+	void ctml_write_iov(CTML_Context* CTML_CTX_NAME, const char* data, size_t length) {
+		if (CTML_CTX_NAME->failed) return;
+		// Room for the buffered data, data, and the buffered data
+		// that ctml_flush_buffer adds after it.
+		if (CTML_CTX_NAME->iovCount + 3 > CTML_IOVEC_MAX) {
+			ctml_flush_buffer(CTML_CTX_NAME);
+		}
+		ctml_iov_add_buffer(CTML_CTX_NAME);
+		struct iovec* iov = &CTML_CTX_NAME->iov[CTML_CTX_NAME->iovCount++];
+		iov->iov_base = (void*)data;
+		iov->iov_len = length;
+	}
+#endif
+
+// Kept for compatibility, length -1 means data is '\0' terminated.
+void ctml_buffered_ctml_output(CTML_Context* CTML_CTX_NAME, char* data, int length) {
+	ctml_write(CTML_CTX_NAME, data, length < 0 ? ctml_strlen(data) : (size_t)length);
+}
+
+int ctml_arena_reserve(CTML_Arena* arena, size_t capacity) {
+	if (capacity <= arena->capacity) return 1;
+	// Growing by big steps keeps the number of copies low.
+	size_t grown = arena->capacity * 2;
+	if (grown < capacity) {
+		grown = (capacity + CTML_ARENA_CHUNK - 1) / CTML_ARENA_CHUNK * CTML_ARENA_CHUNK;
+	}
+	#ifdef CTML_REALLOC
+		char* data = CTML_REALLOC(arena->data, grown);
+	#else
+		// Without allocator, the arena can only use the memory it was given.
+		char* data = NULL;
+	#endif
+	if (data == NULL) {
+		arena->failed = 1;
+		return 0;
+	}
+	arena->data = data;
+	arena->capacity = grown;
+	arena->allocations++;
+	return 1;
+}
+
+void ctml_arena_reset(CTML_Arena* arena) {
+	arena->length = 0;
+	arena->failed = 0;
+	if (arena->data != NULL) {
+		arena->data[0] = '\0';
+	}
+}
+
+void ctml_arena_free(CTML_Arena* arena) {
+	#ifdef CTML_REALLOC
+		CTML_FREE(arena->data);
+	#endif
+	arena->data = NULL;
+	arena->length = 0;
+	arena->capacity = 0;
+}
+
+#define CTML_PRIME64_1 0x9E3779B185EBCA87ULL
+#define CTML_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define CTML_PRIME64_3 0x165667B19E3779F9ULL
+#define CTML_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define CTML_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t ctml_rotl64(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+// Little endian loads, whatever the host is (a single load on x86).
+static inline uint64_t ctml_read64(const unsigned char* p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t ctml_read32(const unsigned char* p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t ctml_hash_round(uint64_t acc, uint64_t input) {
+	acc += input * CTML_PRIME64_2;
+	return ctml_rotl64(acc, 31) * CTML_PRIME64_1;
+}
+
+static inline uint64_t ctml_hash_merge(uint64_t acc, uint64_t value) {
+	acc ^= ctml_hash_round(0, value);
+	return acc * CTML_PRIME64_1 + CTML_PRIME64_4;
+}
+
+void ctml_hash_reset(CTML_Hash* hash, uint64_t seed) {
+	hash->total = 0;
+	hash->v[0] = seed + CTML_PRIME64_1 + CTML_PRIME64_2;
+	hash->v[1] = seed + CTML_PRIME64_2;
+	hash->v[2] = seed;
+	hash->v[3] = seed - CTML_PRIME64_1;
+	hash->memorySize = 0;
+	hash->seed = seed;
+}
+
+void ctml_hash_update(CTML_Hash* hash, const void* data, size_t length) {
+	const unsigned char* p = data;
+	const unsigned char* end = p + length;
+	hash->total += length;
+	if (hash->memorySize + length < 32) {
+		if (length != 0) {
+			ctml_memcpy((char*)hash->memory + hash->memorySize, (const char*)p, length);
+		}
+		hash->memorySize += length;
+		return;
+	}
+	if (hash->memorySize != 0) {
+		// Completes the stripe kept from the previous update.
+		size_t n = 32 - hash->memorySize;
+		ctml_memcpy((char*)hash->memory + hash->memorySize, (const char*)p, n);
+		p += n;
+		for (int i = 0; i < 4; i++) {
+			hash->v[i] = ctml_hash_round(hash->v[i], ctml_read64(hash->memory + 8 * i));
+		}
+		hash->memorySize = 0;
+	}
+	uint64_t v0 = hash->v[0], v1 = hash->v[1], v2 = hash->v[2], v3 = hash->v[3];
+	while (end - p >= 32) {
+		v0 = ctml_hash_round(v0, ctml_read64(p));
+		v1 = ctml_hash_round(v1, ctml_read64(p + 8));
+		v2 = ctml_hash_round(v2, ctml_read64(p + 16));
+		v3 = ctml_hash_round(v3, ctml_read64(p + 24));
+		p += 32;
+	}
+	hash->v[0] = v0;
+	hash->v[1] = v1;
+	hash->v[2] = v2;
+	hash->v[3] = v3;
+	if (p != end) {
+		ctml_memcpy((char*)hash->memory, (const char*)p, end - p);
+		hash->memorySize = end - p;
+	}
+}
+
+uint64_t ctml_hash_digest(const CTML_Hash* hash) {
+	uint64_t h;
+	if (hash->total >= 32) {
+		const uint64_t* v = hash->v;
+		h = ctml_rotl64(v[0], 1) + ctml_rotl64(v[1], 7) + ctml_rotl64(v[2], 12) + ctml_rotl64(v[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = ctml_hash_merge(h, v[i]);
+		}
+	} else {
+		h = hash->seed + CTML_PRIME64_5;
+	}
+	h += hash->total;
+
+	const unsigned char* p = hash->memory;
+	size_t left = hash->memorySize;
+	for (; left >= 8; p += 8, left -= 8) {
+		h ^= ctml_hash_round(0, ctml_read64(p));
+		h = ctml_rotl64(h, 27) * CTML_PRIME64_1 + CTML_PRIME64_4;
+	}
+	if (left >= 4) {
+		h ^= (uint64_t)ctml_read32(p) * CTML_PRIME64_1;
+		h = ctml_rotl64(h, 23) * CTML_PRIME64_2 + CTML_PRIME64_3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; p++, left--) {
+		h ^= *p * CTML_PRIME64_5;
+		h = ctml_rotl64(h, 11) * CTML_PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= CTML_PRIME64_2;
+	h ^= h >> 29;
+	h *= CTML_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+// XXH64 of data.
+uint64_t ctml_hash(const void* data, size_t length, uint64_t seed) {
+	CTML_Hash hash;
+	ctml_hash_reset(&hash, seed);
+	ctml_hash_update(&hash, data, length);
+	return ctml_hash_digest(&hash);
+}
+
+// Writes the digest of hash as a strong ETag ("" included).
+void ctml_etag(const CTML_Hash* hash, char etag[CTML_ETAG_SIZE]) {
+	static const char digits[] = "0123456789abcdef";
+	uint64_t digest = ctml_hash_digest(hash);
+	etag[0] = '"';
+	for (int i = 16; i > 0; i--) {
+		etag[i] = digits[digest & 15];
+		digest >>= 4;
+	}
+	etag[17] = '"';
+	etag[18] = '\0';
+}
+
+void ctml_begin(CTML_Context* CTML_CTX_NAME) {
+	CTML_Arena* arena = CTML_CTX_NAME->arena;
+	CTML_CTX_NAME->failed = 0;
+	if (CTML_CTX_NAME->hash) {
+		ctml_hash_reset(CTML_CTX_NAME->hash, 0);
+	}
+	CTML_CTX_NAME->unflushedBytes = 0;
+	if (CTML_CTX_NAME->flushMicroseconds) {
+		CTML_CTX_NAME->lastFlush = CTML_NOW();
+	}
+	if (arena) {
+		if (arena->capacity == 0) {
+			ctml_arena_reserve(arena, CTML_ARENA_CHUNK);
+		}
+		CTML_CTX_NAME->buffer = arena->data;
+		CTML_CTX_NAME->bufferCapacity = arena->capacity ? arena->capacity - 1 : 0;
+		CTML_CTX_NAME->bufferedDataLength = arena->length;
+		return;
+	}
+	CTML_CTX_NAME->buffer = ctml_buffer_start(CTML_CTX_NAME);
+	if (CTML_CTX_NAME->outputBuffer) {
+		size_t size = CTML_CTX_NAME->outputBufferSize;
+		CTML_CTX_NAME->bufferCapacity = size > 1 ? size - 1 : 0;
+	} else {
+		#if CTML_SINK_BUFSIZE > 1
+			CTML_CTX_NAME->bufferCapacity = CTML_BUFFER_CAPACITY;
+		#else
+			CTML_CTX_NAME->bufferCapacity = 0;
+		#endif
+	}
+	int has_writev = 0;
+	#ifdef CTML_IOVEC
+		has_writev = CTML_CTX_NAME->writev != NULL;
+	#endif
+	// Keeps room around the buffer for the chunk header and end,
+	// .writev gets them as separate entries instead (and codecs
+	// send their own buffers).
+	if (CTML_CTX_NAME->chunked && !has_writev && !CTML_CTX_NAME->codec && CTML_CTX_NAME->bufferCapacity > 2 * CTML_CHUNK_OVERHEAD) {
+		CTML_CTX_NAME->buffer += CTML_CHUNK_HEADER;
+		CTML_CTX_NAME->bufferCapacity -= CTML_CHUNK_OVERHEAD;
+	}
+	if (CTML_CTX_NAME->bufferSize && CTML_CTX_NAME->bufferSize < CTML_CTX_NAME->bufferCapacity) {
+		CTML_CTX_NAME->bufferCapacity = CTML_CTX_NAME->bufferSize;
+	}
+}
+
+void ctml_flush_buffer(CTML_Context* CTML_CTX_NAME) {
+	CTML_Arena* arena = CTML_CTX_NAME->arena;
+	if (arena) {
+		// The HTML already is in the arena, it only has to be published.
+		if (CTML_CTX_NAME->hash && CTML_CTX_NAME->bufferedDataLength > arena->length) {
+			ctml_hash_update(CTML_CTX_NAME->hash, arena->data + arena->length, CTML_CTX_NAME->bufferedDataLength - arena->length);
+		}
+		if (CTML_CTX_NAME->bufferedDataLength != arena->length) {
+			CTML_STATS_ADD(flushes, 1);
+			CTML_STATS_ADD(bytes, CTML_CTX_NAME->bufferedDataLength - arena->length);
+		}
+		arena->length = CTML_CTX_NAME->bufferedDataLength;
+		if (arena->data != NULL) {
+			arena->data[arena->length] = '\0';
+		}
+		if (arena->length > arena->peak) {
+			arena->peak = arena->length;
+		}
+		return;
+	}
+	#ifdef CTML_IOVEC
+		if (CTML_CTX_NAME->writev && !CTML_CTX_NAME->codec) {
+			// Sends the whole batch with one call.
+			ctml_iov_add_buffer(CTML_CTX_NAME);
+			if (CTML_CTX_NAME->iovCount != 0) {
+				char header[2 * sizeof(size_t) + 2];
+				if (CTML_CTX_NAME->hash) {
+					for (int i = 0; i < CTML_CTX_NAME->iovCount; i++) {
+						ctml_hash_update(CTML_CTX_NAME->hash, CTML_CTX_NAME->iov[i].iov_base, CTML_CTX_NAME->iov[i].iov_len);
+					}
+				}
+				if (CTML_CTX_NAME->chunked) {
+					// The batch becomes one chunk.
+					struct iovec* iov = CTML_CTX_NAME->iov;
+					int count = CTML_CTX_NAME->iovCount;
+					size_t length = 0;
+					for (int i = count; i > 0; i--) {
+						iov[i] = iov[i - 1];
+						length += iov[i].iov_len;
+					}
+					size_t header_length = ctml_chunk_header(header + sizeof(header), length);
+					iov[0].iov_base = header + sizeof(header) - header_length;
+					iov[0].iov_len = header_length;
+					iov[count + 1].iov_base = (void*)"\r\n";
+					iov[count + 1].iov_len = 2;
+					CTML_CTX_NAME->iovCount = count + 2;
+				}
+				#ifdef CTML_STATS
+					uint64_t start = CTML_STATS_NOW();
+					for (int i = 0; i < CTML_CTX_NAME->iovCount; i++) {
+						CTML_STATS_ADD(bytes, CTML_CTX_NAME->iov[i].iov_len);
+					}
+					CTML_STATS_ADD(flushes, 1);
+					CTML_STATS_ADD(sinkCalls, 1);
+				#endif
+				int failed = CTML_CTX_NAME->writev(CTML_CTX_NAME->iov, CTML_CTX_NAME->iovCount, CTML_CTX_NAME->userData);
+				#ifdef CTML_STATS
+					CTML_STATS_ADD(sinkNanoseconds, CTML_STATS_NOW() - start);
+				#endif
+				if (failed) {
+					ctml_fail(CTML_CTX_NAME);
+					return;
+				}
+			}
+			CTML_CTX_NAME->iovCount = 0;
+			CTML_CTX_NAME->iovBufferStart = 0;
+			CTML_CTX_NAME->bufferedDataLength = 0;
+			return;
+		}
+	#endif
+	if (CTML_CTX_NAME->bufferedDataLength != 0) {
+		CTML_STATS_ADD(flushes, 1);
+		ctml_sink_write(CTML_CTX_NAME, CTML_CTX_NAME->buffer, CTML_CTX_NAME->bufferedDataLength);
+		CTML_CTX_NAME->bufferedDataLength = 0;
+	}
+}
+
+// Sends everything written so far to the sink right away,
+// including what the codec holds (like the <head> of a page
+// before running the queries of its body).
+void ctml_flush(CTML_Context* CTML_CTX_NAME) {
+	ctml_flush_buffer(CTML_CTX_NAME);
+	if (CTML_CTX_NAME->codec && !CTML_CTX_NAME->arena && !CTML_CTX_NAME->failed && CTML_CTX_NAME->unflushedBytes != 0 &&
+	    CTML_CTX_NAME->codec->encode(CTML_CTX_NAME->codec, CTML_CTX_NAME, NULL, 0, CTML_CODEC_FLUSH) != 0) {
+		ctml_fail(CTML_CTX_NAME);
+	}
+	CTML_CTX_NAME->unflushedBytes = 0;
+	if (CTML_CTX_NAME->flushMicroseconds) {
+		CTML_CTX_NAME->lastFlush = CTML_NOW();
+	}
+}
+
+// Flushes if the auto-flush policy says so.
+static void ctml_auto_flush(CTML_Context* CTML_CTX_NAME) {
+	size_t waiting = CTML_CTX_NAME->bufferedDataLength + CTML_CTX_NAME->unflushedBytes;
+	int empty = waiting == 0;
+	#ifdef CTML_IOVEC
+		// Literals referenced by a .writev batch are not counted in waiting.
+		empty = empty && CTML_CTX_NAME->iovCount == 0;
+	#endif
+	if (empty || CTML_CTX_NAME->arena) return;
+	if ((CTML_CTX_NAME->flushBytes && waiting >= CTML_CTX_NAME->flushBytes) ||
+	    (CTML_CTX_NAME->flushMicroseconds &&
+	     CTML_NOW() - CTML_CTX_NAME->lastFlush >= (uint64_t)CTML_CTX_NAME->flushMicroseconds * 1000)) {
+		ctml_flush(CTML_CTX_NAME);
+	}
+}
+
+// Called at the end of ctml().
+void ctml_end(CTML_Context* CTML_CTX_NAME) {
+	ctml_flush_buffer(CTML_CTX_NAME);
+	// The codec is finished even after a failure, so it can be reused.
+	if (CTML_CTX_NAME->codec && !CTML_CTX_NAME->arena &&
+	    CTML_CTX_NAME->codec->encode(CTML_CTX_NAME->codec, CTML_CTX_NAME, NULL, 0, CTML_CODEC_FINISH) != 0) {
+		ctml_fail(CTML_CTX_NAME);
+	}
+	if (CTML_CTX_NAME->chunked && !CTML_CTX_NAME->arena) {
+		// Last chunk, without trailers.
+		ctml_sink_send(CTML_CTX_NAME, "0\r\n\r\n", 5);
+	}
+	#ifdef CTML_STATS
+		if (CTML_CTX_NAME->onStats) {
+			CTML_CTX_NAME->onStats(&CTML_CTX_NAME->stats, CTML_CTX_NAME->userData);
+		}
+	#endif
+}
+
+
+
+// Writes count spaces.
+void ctml_spaces(CTML_Context* CTML_CTX_NAME, int count) {
+	static const char spaces[] = "                                ";
+	while (count > 0) {
+		int n = count < (int)sizeof(spaces) - 1 ? count : (int)sizeof(spaces) - 1;
+		ctml_write(CTML_CTX_NAME, spaces, n);
+		count -= n;
+	}
+}
+
+#ifndef CTML_NOLIBC
+	void ctml_vformat(CTML_Context* CTML_CTX_NAME, const char* format, va_list args) {
+		va_list args_copy;
+		int length;
+		if (CTML_CTX_NAME->failed) return;
+		// The '\0' written by vsnprintf goes in the byte kept
+		// after the capacity of the buffer, so it is not lost space.
+		char small[256];
+		char* dst = CTML_CTX_NAME->buffer + CTML_CTX_NAME->bufferedDataLength;
+		size_t available = CTML_CTX_NAME->bufferCapacity - CTML_CTX_NAME->bufferedDataLength;
+		if (CTML_CTX_NAME->bufferCapacity == 0) {
+			// Without buffer, small results are formatted on the stack.
+			dst = small;
+			available = sizeof(small) - 1;
+		}
+		va_copy(args_copy, args);
+		length = vsnprintf(dst, available + 1, format, args_copy);
+		va_end(args_copy);
+		if (length < 0) return;
+		if ((size_t)length <= available) {
+			if (dst == small) {
+				ctml_write(CTML_CTX_NAME, small, length);
+			} else {
+				CTML_CTX_NAME->bufferedDataLength += length;
+			}
+			return;
+		}
+		// It did not fit, but it fits in a flushed buffer (or a grown arena).
+		dst = ctml_reserve(CTML_CTX_NAME, length);
+		if (dst != NULL) {
+			vsnprintf(dst, (size_t)length + 1, format, args);
+			CTML_CTX_NAME->bufferedDataLength += length;
+			return;
+		}
+		// Bigger than the buffer, so it is formatted on the heap and
+		// sent in one go (see ctml_write_slow).
+		char* formatted = CTML_MALLOC((size_t)length + 1);
+		if (formatted == NULL) return;
+		vsnprintf(formatted, (size_t)length + 1, format, args);
+		ctml_write(CTML_CTX_NAME, formatted, length);
+		CTML_FREE(formatted);
+	}
+
+	void ctml_format(CTML_Context* CTML_CTX_NAME, const char* format, ...) {
+		va_list args;
+		va_start(args, format);
+		ctml_vformat(CTML_CTX_NAME, format, args);
+		va_end(args);
+	}
+
+	// Length modifiers of a conversion specification
+	enum {
+		CTML_LENGTH_NONE,
+		CTML_LENGTH_HH,
+		CTML_LENGTH_H,
+		CTML_LENGTH_L,
+		CTML_LENGTH_LL,
+		CTML_LENGTH_J,
+		CTML_LENGTH_Z,
+		CTML_LENGTH_T,
+		CTML_LENGTH_LONG_DOUBLE,
+	};
+
+	// Formats a single numeric argument with spec, a printf conversion
+	// specification where '*' have been replaced by their value.
+	// What printf writes for numbers never has to be escaped.
+	// Returns 0 (and takes no argument) if conversion is not a number.
+	// spec is built at runtime, its argument type is picked by the switch.
+	#if defined(__GNUC__)
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+	#endif
+	static int ctml_format_number(CTML_Context* CTML_CTX_NAME, const char* spec, char conversion, int length_modifier, va_list* args) {
+		switch (conversion) {
+			case 'd': case 'i':
+				switch (length_modifier) {
+					case CTML_LENGTH_L:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, long)); break;
+					case CTML_LENGTH_LL: ctml_format(CTML_CTX_NAME, spec, va_arg(*args, long long)); break;
+					case CTML_LENGTH_J:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, intmax_t)); break;
+					case CTML_LENGTH_Z:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, size_t)); break;
+					case CTML_LENGTH_T:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, ptrdiff_t)); break;
+					default:             ctml_format(CTML_CTX_NAME, spec, va_arg(*args, int)); break;
+				}
+				break;
+			case 'u': case 'o': case 'x': case 'X':
+				switch (length_modifier) {
+					case CTML_LENGTH_L:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, unsigned long)); break;
+					case CTML_LENGTH_LL: ctml_format(CTML_CTX_NAME, spec, va_arg(*args, unsigned long long)); break;
+					case CTML_LENGTH_J:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, uintmax_t)); break;
+					case CTML_LENGTH_Z:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, size_t)); break;
+					case CTML_LENGTH_T:  ctml_format(CTML_CTX_NAME, spec, va_arg(*args, ptrdiff_t)); break;
+					default:             ctml_format(CTML_CTX_NAME, spec, va_arg(*args, unsigned int)); break;
+				}
+				break;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+				if (length_modifier == CTML_LENGTH_LONG_DOUBLE) {
+					ctml_format(CTML_CTX_NAME, spec, va_arg(*args, long double));
+				} else {
+					ctml_format(CTML_CTX_NAME, spec, va_arg(*args, double));
+				}
+				break;
+			case 'p':
+				ctml_format(CTML_CTX_NAME, spec, va_arg(*args, void*));
+				break;
+			default:
+				return 0;
+		}
+		return 1;
+	}
+	#if defined(__GNUC__)
+		#pragma GCC diagnostic pop
+	#endif
+
+	// Same as ctml_vformat except that the text substituted for %s and %c
+	// is escaped. The format is parsed here: text of the format is sent as it
+	// is, strings are escaped directly from the arguments and numbers are
+	// formatted in the context buffer by ctml_format.
+	// Wide characters (%lc, %ls) are not supported. As the type of their
+	// argument is unknown, they and unknown conversions are written as they
+	// are and the rest of the format is dropped (the next arguments cannot
+	// be found anymore).
+	void ctml_escape_vformat(CTML_Context* CTML_CTX_NAME, const char* format, va_list args) {
+		va_list args_copy;
+		va_copy(args_copy, args);
+		const char* p = format;
+		while (*p != '\0') {
+			const char* percent = strchr(p, '%');
+			if (percent == NULL) {
+				ctml_write(CTML_CTX_NAME, p, strlen(p));
+				break;
+			}
+			ctml_write(CTML_CTX_NAME, p, percent - p);
+			p = percent + 1;
+			if (*p == '%') {
+				ctml_output_lit("%");
+				p++;
+				continue;
+			}
+
+			// Conversion specification: %[flags][width][.precision][length]conversion
+			char spec[64];
+			size_t spec_length = 0;
+			int left_justify = 0, width = -1, precision = -1;
+			spec[spec_length++] = '%';
+			while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+				if (*p == '-') left_justify = 1;
+				if (spec_length < 8) spec[spec_length++] = *p;
+				p++;
+			}
+			if (*p == '*') {
+				width = va_arg(args_copy, int);
+				if (width < 0) {
+					left_justify = 1;
+					width = -width;
+				}
+				p++;
+			} else if (*p >= '0' && *p <= '9') {
+				width = 0;
+				while (*p >= '0' && *p <= '9') width = width * 10 + (*p++ - '0');
+			}
+			if (*p == '.') {
+				p++;
+				precision = 0;
+				if (*p == '*') {
+					precision = va_arg(args_copy, int);
+					p++;
+				} else {
+					while (*p >= '0' && *p <= '9') precision = precision * 10 + (*p++ - '0');
+				}
+			}
+			const char* length_start = p;
+			int length_modifier = CTML_LENGTH_NONE;
+			switch (*p) {
+				case 'h': length_modifier = p[1] == 'h' ? CTML_LENGTH_HH : CTML_LENGTH_H; break;
+				case 'l': length_modifier = p[1] == 'l' ? CTML_LENGTH_LL : CTML_LENGTH_L; break;
+				case 'j': length_modifier = CTML_LENGTH_J; break;
+				case 'z': length_modifier = CTML_LENGTH_Z; break;
+				case 't': length_modifier = CTML_LENGTH_T; break;
+				case 'L': length_modifier = CTML_LENGTH_LONG_DOUBLE; break;
+			}
+			if (length_modifier == CTML_LENGTH_HH || length_modifier == CTML_LENGTH_LL) {
+				p += 2;
+			} else if (length_modifier != CTML_LENGTH_NONE) {
+				p++;
+			}
+			char conversion = *p;
+			if (conversion == '\0') break;
+			p++;
+
+			if ((conversion == 's' || conversion == 'c') && length_modifier != CTML_LENGTH_NONE) {
+				ctml_write(CTML_CTX_NAME, percent, p - percent);
+				break;
+			}
+			if (conversion == 's' || conversion == 'c') {
+				char c;
+				const char* text;
+				size_t text_length;
+				if (conversion == 'c') {
+					c = (char)va_arg(args_copy, int);
+					text = &c;
+					text_length = 1;
+				} else {
+					text = va_arg(args_copy, const char*);
+					if (text == NULL) text = "(null)";
+					text_length = 0;
+					while ((precision < 0 || text_length < (size_t)precision) && text[text_length] != '\0') {
+						text_length++;
+					}
+				}
+				int padding = width > (int)text_length ? width - (int)text_length : 0;
+				if (!left_justify) ctml_spaces(CTML_CTX_NAME, padding);
+				ctml_escape_textn(CTML_CTX_NAME, text, text_length);
+				if (left_justify) ctml_spaces(CTML_CTX_NAME, padding);
+			} else if (conversion == 'n') {
+				// Nothing is counted.
+				(void)va_arg(args_copy, void*);
+			} else {
+				if (left_justify) spec[spec_length++] = '-';
+				if (width >= 0) spec_length += snprintf(spec + spec_length, 12, "%d", width);
+				if (precision >= 0) spec_length += snprintf(spec + spec_length, 13, ".%d", precision);
+				while (length_start < p) spec[spec_length++] = *length_start++;
+				spec[spec_length] = '\0';
+				if (!ctml_format_number(CTML_CTX_NAME, spec, conversion, length_modifier, &args_copy)) {
+					ctml_write(CTML_CTX_NAME, percent, p - percent);
+					break;
+				}
+			}
+		}
+		va_end(args_copy);
+	}
+
+	void ctml_escape_format(CTML_Context* CTML_CTX_NAME, const char* format, ...) {
+		va_list args;
+		va_start(args, format);
+		ctml_escape_vformat(CTML_CTX_NAME, format, args);
+		va_end(args);
+	}
+#endif // CTML_NOLIBC
+
+// Numbers are at most that long (including the sign and separators).
+#define CTML_NUMBER_MAX_LENGTH 32
+
+// Returns where a number of at most CTML_NUMBER_MAX_LENGTH chars can be written:
+// directly in the buffer if it is big enough, or in space otherwise.
+static char* ctml_number_begin(CTML_Context* CTML_CTX_NAME, char* space) {
+	char* number = ctml_reserve(CTML_CTX_NAME, CTML_NUMBER_MAX_LENGTH);
+	return number != NULL ? number : space;
+}
+
+static void ctml_number_end(CTML_Context* CTML_CTX_NAME, const char* number, size_t length) {
+	if (number == CTML_CTX_NAME->buffer + CTML_CTX_NAME->bufferedDataLength) {
+		CTML_CTX_NAME->bufferedDataLength += length;
+	} else {
+		ctml_write(CTML_CTX_NAME, number, length);
+	}
+}
+
+static const char ctml_digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t ctml_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+	10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static int ctml_count_digits(uint64_t value) {
+	int count = 1;
+	for (;;) {
+		if (value < 10) return count;
+		if (value < 100) return count + 1;
+		if (value < 1000) return count + 2;
+		if (value < 10000) return count + 3;
+		value /= 10000;
+		count += 4;
+	}
+}
+
+// Writes the digits of value, two at a time, so that they end right before end.
+static void ctml_digits(char* end, uint64_t value) {
+	while (value >= 100) {
+		unsigned int pair = (unsigned int)(value % 100) * 2;
+		value /= 100;
+		*--end = ctml_digit_pairs[pair + 1];
+		*--end = ctml_digit_pairs[pair];
+	}
+	if (value >= 10) {
+		*--end = ctml_digit_pairs[value * 2 + 1];
+		*--end = ctml_digit_pairs[value * 2];
+	} else {
+		*--end = (char)('0' + value);
+	}
+}
+
+void ctml_write_uint64(CTML_Context* CTML_CTX_NAME, uint64_t value) {
+	char space[CTML_NUMBER_MAX_LENGTH];
+	char* number = ctml_number_begin(CTML_CTX_NAME, space);
+	int length = ctml_count_digits(value);
+	ctml_digits(number + length, value);
+	ctml_number_end(CTML_CTX_NAME, number, length);
+}
+
+void ctml_write_int(CTML_Context* CTML_CTX_NAME, long long value) {
+	char space[CTML_NUMBER_MAX_LENGTH];
+	char* number = ctml_number_begin(CTML_CTX_NAME, space);
+	uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	int length = 0;
+	if (value < 0) number[length++] = '-';
+	length += ctml_count_digits(magnitude);
+	ctml_digits(number + length, magnitude);
+	ctml_number_end(CTML_CTX_NAME, number, length);
+}
+
+void ctml_write_int_grouped(CTML_Context* CTML_CTX_NAME, long long value, char separator) {
+	char space[CTML_NUMBER_MAX_LENGTH];
+	char* number = ctml_number_begin(CTML_CTX_NAME, space);
+	uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	int length = 0;
+	if (value < 0) number[length++] = '-';
+	int digits = ctml_count_digits(magnitude);
+	length += digits + (digits - 1) / 3;
+	char* end = number + length;
+	for (int i = 0; i < digits; i++) {
+		if (i != 0 && i % 3 == 0) *--end = separator;
+		*--end = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	}
+	ctml_number_end(CTML_CTX_NAME, number, length);
+}
+
+// Shortest representation of doubles using the Grisu2 algorithm
+// (Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers"). The output always reads back as the same double and is
+// the shortest one in almost all cases.
+typedef struct {
+	uint64_t f;
+	int e;
+} CTML_DiyFp;
+
+// Powers of ten from 10^-348 to 10^340 (every 8) as normalized 64 bits
+// significands and binary exponents.
+static const uint64_t ctml_cached_powers_f[] = {
+	0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+	0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+	0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+	0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+	0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+	0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+	0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+	0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+	0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+	0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+	0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+	0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+	0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+	0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+	0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+	0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+	0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+	0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+	0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+	0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+	0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+	0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+static const short ctml_cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+	-901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+	-582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+	-263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+	56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+	694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+	1013, 1039, 1066,
+};
+
+static CTML_DiyFp ctml_diyfp_multiply(CTML_DiyFp x, CTML_DiyFp y) {
+	const uint64_t mask32 = 0xFFFFFFFFu;
+	uint64_t a = x.f >> 32, b = x.f & mask32, c = y.f >> 32, d = y.f & mask32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t middle = (bd >> 32) + (ad & mask32) + (bc & mask32) + (1U << 31);
+	CTML_DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+	return result;
+}
+
+static void ctml_grisu_round(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		digits[length - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static void ctml_grisu_digits(CTML_DiyFp w, CTML_DiyFp mp, uint64_t delta, char* digits, int* length, int* k) {
+	const CTML_DiyFp one = {1ULL << -mp.e, mp.e};
+	const uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+	uint64_t p2 = mp.f & (one.f - 1);
+	int kappa = ctml_count_digits(p1);
+	*length = 0;
+	while (kappa > 0) {
+		uint32_t d = (uint32_t)(p1 / ctml_pow10[kappa - 1]);
+		p1 %= ctml_pow10[kappa - 1];
+		if (d || *length) digits[(*length)++] = (char)('0' + d);
+		kappa--;
+		uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+		if (rest <= delta) {
+			*k += kappa;
+			ctml_grisu_round(digits, *length, delta, rest, ctml_pow10[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> -one.e);
+		if (d || *length) digits[(*length)++] = (char)('0' + d);
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			ctml_grisu_round(digits, *length, delta, p2, one.f, wp_w * (-kappa < 20 ? ctml_pow10[-kappa] : 0));
+			return;
+		}
+	}
+}
+
+// Writes the digits of a positive, finite and non zero double with value = digits * 10^k.
+static void ctml_grisu2(uint64_t bits, char* digits, int* length, int* k) {
+	int biased_exponent = (int)(bits >> 52);
+	CTML_DiyFp v = {bits & 0xFFFFFFFFFFFFFULL, -1074};
+	if (biased_exponent != 0) {
+		v.f |= 1ULL << 52;
+		v.e = biased_exponent - 1075;
+	}
+
+	// Boundaries between v and its neighbours
+	CTML_DiyFp plus = {(v.f << 1) + 1, v.e - 1};
+	while (!(plus.f & (1ULL << 53))) {
+		plus.f <<= 1;
+		plus.e--;
+	}
+	plus.f <<= 10;
+	plus.e -= 10;
+	CTML_DiyFp minus = {(v.f << 1) - 1, v.e - 1};
+	if (v.f == 1ULL << 52) {
+		minus.f = (v.f << 2) - 1;
+		minus.e = v.e - 2;
+	}
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	while (!(v.f & (1ULL << 63))) {
+		v.f <<= 1;
+		v.e--;
+	}
+
+	// Cached power of ten bringing the exponent in [-60, -32]
+	double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (dk - ik > 0.0) ik++;
+	unsigned int index = (unsigned int)((ik >> 3) + 1);
+	CTML_DiyFp cached = {ctml_cached_powers_f[index], ctml_cached_powers_e[index]};
+	*k = -(-348 + (int)(index << 3));
+
+	CTML_DiyFp w = ctml_diyfp_multiply(v, cached);
+	CTML_DiyFp wp = ctml_diyfp_multiply(plus, cached);
+	CTML_DiyFp wm = ctml_diyfp_multiply(minus, cached);
+	wm.f++;
+	wp.f--;
+	ctml_grisu_digits(w, wp, wp.f - wm.f, digits, length, k);
+}
+
+// Writes the shortest representation of a finite double, like
+// javascript does: 0.000001, 123.45, 1e+21, 1.5e-7
+static int ctml_format_shortest(char* number, uint64_t bits) {
+	int length = 0;
+	if (bits >> 63) {
+		number[length++] = '-';
+		bits &= ~(1ULL << 63);
+	}
+	if (bits == 0) {
+		number[length++] = '0';
+		return length;
+	}
+	char digits[20];
+	int count, k;
+	ctml_grisu2(bits, digits, &count, &k);
+	// Position of the decimal point from the first digit
+	int point = count + k;
+	if (k >= 0 && point <= 21) {
+		for (int i = 0; i < count; i++) number[length++] = digits[i];
+		for (int i = 0; i < k; i++) number[length++] = '0';
+	} else if (point > 0 && point <= 21) {
+		for (int i = 0; i < count; i++) {
+			if (i == point) number[length++] = '.';
+			number[length++] = digits[i];
+		}
+	} else if (point > -6 && point <= 0) {
+		number[length++] = '0';
+		number[length++] = '.';
+		for (int i = point; i < 0; i++) number[length++] = '0';
+		for (int i = 0; i < count; i++) number[length++] = digits[i];
+	} else {
+		number[length++] = digits[0];
+		if (count > 1) {
+			number[length++] = '.';
+			for (int i = 1; i < count; i++) number[length++] = digits[i];
+		}
+		int exponent = point - 1;
+		number[length++] = 'e';
+		number[length++] = exponent < 0 ? '-' : '+';
+		if (exponent < 0) exponent = -exponent;
+		int exponent_length = ctml_count_digits((uint64_t)exponent);
+		ctml_digits(number + length + exponent_length, (uint64_t)exponent);
+		length += exponent_length;
+	}
+	return length;
+}
+
+// Exact error of the product a * b rounded to p (Dekker's algorithm).
+static double ctml_product_error(double a, double b, double p) {
+	const double split = 134217729.0; // 2^27 + 1
+	double t = a * split, a_high = t - (t - a), a_low = a - a_high;
+	t = b * split;
+	double b_high = t - (t - b), b_low = b - b_high;
+	return ((a_high * b_high - p) + a_high * b_low + a_low * b_high) + a_low * b_low;
+}
+
+#ifdef CTML_NOLIBC
+	// Unsigned big integers, as 32 bits limbs (least significant first),
+	// for the fixed notation of any double without printf. 120 limbs
+	// hold 2^53 * 10^1074, the biggest value it needs.
+	#define CTML_BIG_LIMBS 120
+	typedef struct {
+		uint32_t limbs[CTML_BIG_LIMBS];
+		int length;
+	} CTML_Big;
+
+	static void ctml_big_trim(CTML_Big* big) {
+		while (big->length > 0 && big->limbs[big->length - 1] == 0) big->length--;
+	}
+
+	static void ctml_big_multiply(CTML_Big* big, uint32_t factor) {
+		uint64_t carry = 0;
+		for (int i = 0; i < big->length; i++) {
+			uint64_t product = (uint64_t)big->limbs[i] * factor + carry;
+			big->limbs[i] = (uint32_t)product;
+			carry = product >> 32;
+		}
+		if (carry) big->limbs[big->length++] = (uint32_t)carry;
+	}
+
+	static void ctml_big_shift_left(CTML_Big* big, int shift) {
+		int words = shift / 32, bits = shift % 32;
+		big->limbs[big->length + words] = 0;
+		for (int i = big->length - 1; i >= 0; i--) {
+			uint32_t limb = big->limbs[i];
+			if (bits) big->limbs[i + words + 1] |= limb >> (32 - bits);
+			big->limbs[i + words] = limb << bits;
+		}
+		for (int i = 0; i < words; i++) big->limbs[i] = 0;
+		big->length += words + 1;
+		ctml_big_trim(big);
+	}
+
+	static void ctml_big_shift_right(CTML_Big* big, int shift) {
+		int words = shift / 32, bits = shift % 32;
+		for (int i = 0; i + words < big->length; i++) {
+			uint32_t limb = big->limbs[i + words] >> bits;
+			if (bits && i + words + 1 < big->length) limb |= big->limbs[i + words + 1] << (32 - bits);
+			big->limbs[i] = limb;
+		}
+		big->length = big->length > words ? big->length - words : 0;
+		ctml_big_trim(big);
+	}
+
+	static int ctml_big_bit(const CTML_Big* big, int bit) {
+		return bit / 32 < big->length && (big->limbs[bit / 32] >> (bit % 32) & 1);
+	}
+
+	// Whether any bit under bit is set.
+	static int ctml_big_any_below(const CTML_Big* big, int bit) {
+		for (int i = 0; i < bit / 32 && i < big->length; i++) {
+			if (big->limbs[i]) return 1;
+		}
+		return bit / 32 < big->length && (big->limbs[bit / 32] & ((1u << (bit % 32)) - 1));
+	}
+
+	static void ctml_big_increment(CTML_Big* big) {
+		for (int i = 0; i < big->length; i++) {
+			if (++big->limbs[i] != 0) return;
+		}
+		big->limbs[big->length++] = 1;
+	}
+
+	// Divides big by divisor and returns the remainder.
+	static uint32_t ctml_big_divide(CTML_Big* big, uint32_t divisor) {
+		uint64_t rest = 0;
+		for (int i = big->length - 1; i >= 0; i--) {
+			uint64_t current = (rest << 32) | big->limbs[i];
+			big->limbs[i] = (uint32_t)(current / divisor);
+			rest = current % divisor;
+		}
+		ctml_big_trim(big);
+		return (uint32_t)rest;
+	}
+
+	// Fixed notation of any finite double with any precision, exact and
+	// rounded half to even like printf.
+	static void ctml_write_fixed(CTML_Context* CTML_CTX_NAME, uint64_t bits, int precision) {
+		int biased_exponent = (int)(bits >> 52 & 0x7FF);
+		uint64_t significand = bits & 0xFFFFFFFFFFFFFULL;
+		int exponent = -1074;
+		if (biased_exponent != 0) {
+			significand |= 1ULL << 52;
+			exponent = biased_exponent - 1075;
+		}
+		// The decimals after the 1074th are zeros (2^-1074 has 1074 of them).
+		int decimals = precision < 1074 ? precision : 1074;
+		CTML_Big big = {{(uint32_t)significand, (uint32_t)(significand >> 32)}, 2};
+		ctml_big_trim(&big);
+		if (exponent >= 0) {
+			ctml_big_shift_left(&big, exponent);
+			decimals = 0;
+		} else {
+			// big = value * 10^decimals, rounded to an integer.
+			int scale = decimals;
+			for (; scale >= 9; scale -= 9) ctml_big_multiply(&big, 1000000000u);
+			if (scale) ctml_big_multiply(&big, (uint32_t)ctml_pow10[scale]);
+			int half = ctml_big_bit(&big, -exponent - 1);
+			int above_half = ctml_big_any_below(&big, -exponent - 1);
+			ctml_big_shift_right(&big, -exponent);
+			if (half && (above_half || (big.length && (big.limbs[0] & 1)))) {
+				ctml_big_increment(&big);
+			}
+		}
+		// Written backwards, 9 digits at a time.
+		char text[1104];
+		char* end = text + sizeof(text);
+		char* number = end;
+		int count = 0;
+		while (big.length != 0 || count <= decimals) {
+			uint32_t chunk = ctml_big_divide(&big, 1000000000u);
+			for (int i = 0; i < 9; i++, count++) {
+				if (count == decimals && decimals) *--number = '.';
+				*--number = (char)('0' + chunk % 10);
+				chunk /= 10;
+			}
+		}
+		while (*number == '0' && number + 1 < end && number[1] != '.') number++;
+		if (bits >> 63) *--number = '-';
+		ctml_write(CTML_CTX_NAME, number, (size_t)(end - number));
+		if (precision > decimals) {
+			if (decimals == 0) ctml_output_lit(".");
+			for (int zeros = precision - decimals; zeros > 0; zeros -= 16) {
+				ctml_write(CTML_CTX_NAME, "0000000000000000", zeros < 16 ? (size_t)zeros : 16);
+			}
+		}
+	}
+#endif // CTML_NOLIBC
+
+void ctml_write_double(CTML_Context* CTML_CTX_NAME, double value, int precision) {
+	uint64_t bits;
+	ctml_memcpy((char*)&bits, (const char*)&value, sizeof(bits));
+	int negative = (int)(bits >> 63);
+	if ((bits & 0x7FF0000000000000ULL) == 0x7FF0000000000000ULL) {
+		if (bits & 0xFFFFFFFFFFFFFULL) {
+			ctml_output_lit("nan");
+		} else if (negative) {
+			ctml_output_lit("-inf");
+		} else {
+			ctml_output_lit("inf");
+		}
+		return;
+	}
+
+	char space[CTML_NUMBER_MAX_LENGTH];
+	double magnitude = negative ? -value : value;
+	if (precision < 0) {
+		char* number = ctml_number_begin(CTML_CTX_NAME, space);
+		ctml_number_end(CTML_CTX_NAME, number, ctml_format_shortest(number, bits));
+		return;
+	}
+	// Fixed notation, rounded half to even like printf. Up to 2^53 the integer
+	// part is exact, and the fraction is scaled to an integer.
+	if (precision <= 9 && magnitude < 9007199254740992.0) {
+		uint64_t integer = (uint64_t)magnitude;
+		double scaled = (magnitude - (double)integer) * (double)ctml_pow10[precision];
+		uint64_t fraction = (uint64_t)scaled;
+		double rest = scaled - (double)fraction;
+		uint64_t last_digit = precision ? fraction : integer;
+		// scaled is rounded, so when it looks like a tie the rounding
+		// error of the multiplication tells on which side the exact value is.
+		if (rest == 0.5) {
+			double error = ctml_product_error(magnitude - (double)integer, (double)ctml_pow10[precision], scaled);
+			rest += error > 0 ? 0.25 : error < 0 ? -0.25 : 0;
+		}
+		if (rest > 0.5 || (rest == 0.5 && (last_digit & 1))) {
+			fraction++;
+			if (fraction >= ctml_pow10[precision]) {
+				fraction -= ctml_pow10[precision];
+				integer++;
+			}
+		}
+		char* number = ctml_number_begin(CTML_CTX_NAME, space);
+		int length = 0;
+		if (negative) number[length++] = '-';
+		length += ctml_count_digits(integer);
+		ctml_digits(number + length, integer);
+		if (precision > 0) {
+			number[length++] = '.';
+			ctml_digits(number + length + precision, fraction + ctml_pow10[precision]);
+			// The added power of ten gave the leading zeros, its 1 is overwritten by the point.
+			number[length - 1] = '.';
+			length += precision;
+		}
+		ctml_number_end(CTML_CTX_NAME, number, length);
+		return;
+	}
+	#ifndef CTML_NOLIBC
+		ctml_format(CTML_CTX_NAME, "%.*f", precision, value);
+	#else
+		ctml_write_fixed(CTML_CTX_NAME, bits, precision);
+	#endif
+}
+
+#ifdef CTML_PRETTY
+	void ctml_indent(CTML_Context* CTML_CTX_NAME, int count) {
+		if (CTML_CTX_NAME->recorder) return;
+		ctml_spaces(CTML_CTX_NAME, count);
+	}
+#endif // CTML_PRETTY
+
+#ifdef CTML_PRETTY
+	void ctml_write_static_pretty(CTML_Context* CTML_CTX_NAME, const char* fragment, size_t length) {
+		int indent = CTML_CTX_NAME->indent;
+		size_t start = 0;
+		for (size_t i = 0; i < length; i++) {
+			char marker = fragment[i];
+			if (marker != CTML_STATIC_INDENT[0] && marker != CTML_STATIC_IN[0] && marker != CTML_STATIC_OUT[0]) {
+				continue;
+			}
+			ctml_write_static(CTML_CTX_NAME, fragment + start, i - start);
+			start = i + 1;
+			if (marker == CTML_STATIC_INDENT[0]) {
+				ctml_indent(CTML_CTX_NAME, indent);
+			} else if (marker == CTML_STATIC_IN[0]) {
+				indent++;
+			} else {
+				indent--;
+			}
+		}
+		ctml_write_static(CTML_CTX_NAME, fragment + start, length - start);
+	}
+#endif // CTML_PRETTY
+
+// Returns 1 when the sink already failed: the tag and its
+// content are then skipped (see ctml_tag).
+int ctml_open_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag) {
+	if (CTML_CTX_NAME->failed) return 1;
+	if (CTML_CTX_NAME->recorder) {
+		CTML_CTX_NAME->recorder->open(CTML_CTX_NAME->recorder, CTML_CTX_NAME, tag);
+		return 0;
+	}
+	#ifdef CTML_PRETTY
+		ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);
 		if (!tag->self_close) {
 			CTML_CTX_NAME->indent++;
 		}
 	#endif
-	ctml_output("<");
-	ctml_output(tag->tag_name);
-
-	#define X(field)                                  \
-		if (tag->field != 0) {                 \
-		        ctml_output(" " #field);          \
-		        ctml_output("=\"");               \
-		        ctml_output(tag->field);          \
-		        ctml_output("\"");                \
-		}                                         
-	#define XL(field, lname)                          \
-		if (tag->field != 0) {                 \
-		        ctml_output(" " #lname);          \
-		        ctml_output("=\"");               \
-		        ctml_output(tag->field);          \
-		        ctml_output("\"");                \
-		}                                         
-	ATTRIBUTES
-	#ifdef CTML_CUSTOM_ATTRIBUTES
-		CTML_CUSTOM_ATTRIBUTES
+	#ifdef CTML_STATS
+		CTML_STATS_ADD(tags, 1);
+		if (!tag->self_close && ++CTML_CTX_NAME->stats.depth > CTML_CTX_NAME->stats.maxDepth) {
+			CTML_CTX_NAME->stats.maxDepth = CTML_CTX_NAME->stats.depth;
+		}
 	#endif
-	#undef X
-	#undef XL
+	if (CTML_CTX_NAME->tagHook) {
+		CTML_CTX_NAME->tagHook->open(CTML_CTX_NAME->tagHook, CTML_CTX_NAME, tag);
+	}
+	ctml_output_lit("<");
+	ctml_write(CTML_CTX_NAME, tag->tag_name, tag->tag_name_length);
+
+	for (unsigned short i = 0; i < tag->count; i++) {
+		switch (tag->attributes[i] & ~CTML_ATTRIBUTE_ESCAPE) {
+			#define X(field)                                   \
+				case CTML_ATTRIBUTE_INDEX(field):          \
+					ctml_output_lit(" " #field "=\""); \
+					break;
+			#define XL(field, lname)                           \
+				case CTML_ATTRIBUTE_INDEX(field):          \
+					ctml_output_lit(" " #lname "=\""); \
+					break;
+			ATTRIBUTES
+			#ifdef CTML_CUSTOM_ATTRIBUTES
+				CTML_CUSTOM_ATTRIBUTES
+			#endif
+			#undef X
+			#undef XL
+		}
+		if (tag->attributes[i] & CTML_ATTRIBUTE_ESCAPE) {
+			ctml_escape_text(CTML_CTX_NAME, tag->values[i]);
+		} else {
+			ctml_output(tag->values[i]);
+		}
+		ctml_output_lit("\"");
+	}
 
 	if (!tag->self_close){
-		ctml_output(">");
+		ctml_output_lit(">");
 	} else {
-		ctml_output("/>");
+		ctml_output_lit("/>");
+		if (CTML_CTX_NAME->tagHook) {
+			CTML_CTX_NAME->tagHook->close(CTML_CTX_NAME->tagHook, CTML_CTX_NAME, tag);
+		}
 	}
 	#ifdef CTML_PRETTY
-		ctml_output("\n");
+		ctml_output_lit("\n");
 	#endif
+	return 0;
 }
 
 void ctml_close_tag(CTML_Context* CTML_CTX_NAME, CTML_Tag* tag) {
 	if (tag->self_close) return;
-	
+	if (CTML_CTX_NAME->recorder) {
+		CTML_CTX_NAME->recorder->close(CTML_CTX_NAME->recorder, CTML_CTX_NAME, tag);
+		return;
+	}
+
 	CTML_CTX_NAME->indent--;
+	CTML_STATS_ADD(depth, -1);
 
 	#ifdef CTML_PRETTY
 		ctml_indent(CTML_CTX_NAME, CTML_CTX_NAME->indent);
 	#endif
 
-	ctml_output("</");
-	ctml_output(tag->tag_name);
-	ctml_output(">");
+	ctml_output_lit("</");
+	ctml_write(CTML_CTX_NAME, tag->tag_name, tag->tag_name_length);
+	ctml_output_lit(">");
+	if (CTML_CTX_NAME->tagHook) {
+		CTML_CTX_NAME->tagHook->close(CTML_CTX_NAME->tagHook, CTML_CTX_NAME, tag);
+	}
 
 	#ifdef CTML_PRETTY
-		ctml_output("\n");
+		ctml_output_lit("\n");
 	#endif
+	if (CTML_CTX_NAME->flushBytes | CTML_CTX_NAME->flushMicroseconds) {
+		ctml_auto_flush(CTML_CTX_NAME);
+	}
 }
 
-void ctml_escape_text(CTML_Context* CTML_CTX_NAME, char* text) {
-	// Not to be escaped count the number of unescaped chars
-	// that could be send in one call to ctml_buffered_ctml_output
-	int not_to_be_escaped = 0;
-	int i;
-	for (i = 0; text[i] != '\0'; i++) {
-
-		if (0) {}
-		#define ESCAPE(char, escaped_version) \
-		else if (text[i] == char) {  \
-		        /* Sending all the text that should not be escaped */ \
-			ctml_buffered_ctml_output(CTML_CTX_NAME, &text[i-not_to_be_escaped], not_to_be_escaped); \
-		        /* Sending escaped version of current char */ \
-			ctml_output(escaped_version); \
-			/* Resetting text that should not be escaped counter */ \
-			not_to_be_escaped = 0; \
-		} \
-
-		ESCAPE('<', "&lt;")
-		ESCAPE('>', "&gt;")
-		ESCAPE('&', "&amp;")
-		ESCAPE('"', "&quot;")
-		ESCAPE('\'', "&#39;") 
-		else {
-			// This char should not be escaped
-			not_to_be_escaped++;
-		}
-	}
-	if (not_to_be_escaped > 0){
-		ctml_buffered_ctml_output(CTML_CTX_NAME, &text[i-not_to_be_escaped], not_to_be_escaped);
+// Characters escaped by ctml_escape_text and their escaped version.
+#define ESCAPES                   \
+	ESCAPE(1, '<', "&lt;")    \
+	ESCAPE(2, '>', "&gt;")    \
+	ESCAPE(3, '&', "&amp;")   \
+	ESCAPE(4, '"', "&quot;")  \
+	ESCAPE(5, '\'', "&#39;")  \
+
+// ctml_escape_table maps a char to its index in ctml_escapes (0 if
+// the char does not need to be escaped).
+static const unsigned char ctml_escape_table[256] = {
+	#define ESCAPE(index, c, escaped_version) [(unsigned char)c] = index,
+	ESCAPES
+	#undef ESCAPE
+};
+// Escaped versions are padded to 8 bytes so that they can be
+// copied with a single store.
+static const struct {
+	char text[8];
+	size_t length;
+} ctml_escapes[] = {
+	{"", 0},
+	#define ESCAPE(index, c, escaped_version) {escaped_version, sizeof(escaped_version) - 1},
+	ESCAPES
+	#undef ESCAPE
+};
+
+// The scanners below return the index of the first char of text
+// to be escaped, or length if there is none.
+static size_t ctml_escape_scan_scalar(const char* text, size_t length) {
+	size_t i = 0;
+	while (i < length && !ctml_escape_table[(unsigned char)text[i]]) {
+		i++;
+	}
+	return i;
+}
+
+#if !defined(CTML_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+	#define CTML_ESCAPE_SIMD
+	#include <immintrin.h>
+
+	// Every char to escape is found with 3 comparisons:
+	// (c|2) == '>' matches '<' and '>', (c|1) == '\'' matches '&' and '\''
+	// and the last one matches '"'.
+	// The last block of text overlaps the previous one instead of going
+	// back to the scalar loop. It is fine as its beginning is known to be clean.
+	#define CTML_ESCAPE_SCAN_SIMD(width, type, load, set1, or, cmpeq, movemask) \
+		const type gt = set1('>'), two = set1(2);                                   \
+		const type quote = set1('\''), one = set1(1);                               \
+		const type dquote = set1('"');                                              \
+		size_t i = 0;                                                               \
+		for (;;) {                                                                  \
+			if (i + width > length) {                                           \
+				if (i == length) break;                                     \
+				i = length - width;                                         \
+			}                                                                   \
+			type v = load((const type*)(text + i));                             \
+			type m = or(or(cmpeq(or(v, two), gt), cmpeq(or(v, one), quote)),   \
+				cmpeq(v, dquote));                                          \
+			unsigned int mask = (unsigned int)movemask(m);                      \
+			if (mask) return i + __builtin_ctz(mask);                           \
+			i += width;                                                         \
+		}                                                                           \
+		return length;
+
+	static size_t ctml_escape_scan_sse2(const char* text, size_t length) {
+		if (length < 16) return ctml_escape_scan_scalar(text, length);
+		CTML_ESCAPE_SCAN_SIMD(16, __m128i, _mm_loadu_si128, _mm_set1_epi8,
+			_mm_or_si128, _mm_cmpeq_epi8, _mm_movemask_epi8)
+	}
+
+	__attribute__((target("avx2")))
+	static size_t ctml_escape_scan_avx2(const char* text, size_t length) {
+		if (length < 32) return ctml_escape_scan_sse2(text, length);
+		CTML_ESCAPE_SCAN_SIMD(32, __m256i, _mm256_loadu_si256, _mm256_set1_epi8,
+			_mm256_or_si256, _mm256_cmpeq_epi8, _mm256_movemask_epi8)
 	}
+
+	// The scanner is picked at the first call depending on the cpu.
+	// Concurrent first calls all store the same pointer.
+	static size_t ctml_escape_scan_resolve(const char* text, size_t length);
+	static size_t (*ctml_escape_scan)(const char* text, size_t length) = ctml_escape_scan_resolve;
+
+	static size_t ctml_escape_scan_resolve(const char* text, size_t length) {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			ctml_escape_scan = ctml_escape_scan_avx2;
+		} else {
+			ctml_escape_scan = ctml_escape_scan_sse2;
+		}
+		return ctml_escape_scan(text, length);
+	}
+#else
+	#define ctml_escape_scan ctml_escape_scan_scalar
+#endif
+
+// Number of clean chars in a row after which ctml_escape_dense
+// goes back to the scanners.
+#define CTML_ESCAPE_DENSE_RUN 4
+
+// Escapes text char by char, directly inside of the buffer, until
+// CTML_ESCAPE_DENSE_RUN chars in a row did not need to be escaped.
+// This is faster than the scanners on text full of chars to escape.
+// Returns the number of chars of text that have been handled.
+static size_t ctml_escape_dense(CTML_Context* CTML_CTX_NAME, const char* text, size_t length) {
+	size_t i;
+	// Every char writes at most 8 bytes (the padded escaped version).
+	// Small buffers are filled through ctml_write instead.
+	char* dst = NULL;
+	if (CTML_CTX_NAME->bufferCapacity > 8 * 4 * CTML_ESCAPE_DENSE_RUN || CTML_CTX_NAME->arena) {
+		dst = ctml_reserve(CTML_CTX_NAME, 8 * CTML_ESCAPE_DENSE_RUN);
+	}
+	if (dst != NULL) {
+		size_t max = (CTML_CTX_NAME->bufferCapacity - CTML_CTX_NAME->bufferedDataLength) / 8;
+		if (max > length) {
+			max = length;
+		}
+		size_t clean = 0;
+		for (i = 0; i < max && clean < CTML_ESCAPE_DENSE_RUN; i++) {
+			unsigned char index = ctml_escape_table[(unsigned char)text[i]];
+			if (index) {
+				ctml_memcpy(dst, ctml_escapes[index].text, 8);
+				dst += ctml_escapes[index].length;
+				clean = 0;
+				CTML_STATS_ADD(bytesEscaped, 1);
+			} else {
+				*dst++ = text[i];
+				clean++;
+				CTML_STATS_ADD(bytesPassedThrough, 1);
+			}
+		}
+		CTML_CTX_NAME->bufferedDataLength = dst - CTML_CTX_NAME->buffer;
+		return i;
+	}
+	for (i = 0; i < length && ctml_escape_table[(unsigned char)text[i]]; i++) {
+		unsigned char index = ctml_escape_table[(unsigned char)text[i]];
+		ctml_write(CTML_CTX_NAME, ctml_escapes[index].text, ctml_escapes[index].length);
+	}
+	CTML_STATS_ADD(bytesEscaped, i);
+	return i;
+}
+
+void ctml_escape_textn(CTML_Context* CTML_CTX_NAME, const char* text, size_t length) {
+	if (CTML_CTX_NAME->failed) return;
+	if (CTML_CTX_NAME->recorder) {
+		CTML_CTX_NAME->recorder->text(CTML_CTX_NAME->recorder, CTML_CTX_NAME, text, length);
+		return;
+	}
+	while (length > 0) {
+		// Sending all the text that should not be escaped at once
+		size_t clean = length < 16 ? ctml_escape_scan_scalar(text, length) : ctml_escape_scan(text, length);
+		ctml_write(CTML_CTX_NAME, text, clean);
+		CTML_STATS_ADD(bytesPassedThrough, clean);
+		text += clean;
+		length -= clean;
+		// Sending escaped version of the chars to escape.
+		if (length > 0) {
+			size_t handled = ctml_escape_dense(CTML_CTX_NAME, text, length);
+			text += handled;
+			length -= handled;
+		}
+	}
+}
+
+void ctml_escape_text(CTML_Context* CTML_CTX_NAME, const char* text) {
+	ctml_escape_textn(CTML_CTX_NAME, text, ctml_strlen(text));
 }
 
 #endif // CTML_IMPLEMENTATION
@@ -0,0 +1,268 @@
+/*
+ * ctml_async.h
+ * * Background writer for ctml: full buffers are handed to a writer thread
+ * * through a lock-free single producer, single consumer ring, and the
+ * * rendering goes on in a free buffer instead of waiting for a slow sink
+ * * (files, pipes). Needs libc, C11 atomics and pthreads. Include it after
+ * * ctml.h (the implementation is enabled by CTML_IMPLEMENTATION as well).
+ * * Example:
+ * CTML_AsyncWriter writer; // ctml_async_init(&writer, 8, 64 * 1024, file_sink, file)
+ * ctml_async(&writer) { report(ctx); }
+ * ctml_async_wait(&writer); // Before closing the file
+ */
+
+#ifndef CTML_ASYNC_H
+#define CTML_ASYNC_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A buffer handed to the writer thread.
+typedef struct {
+	char* buffer;
+	const char* data; // In buffer
+	size_t length;
+} CTML_AsyncEntry;
+
+/*
+ * CTML_AsyncWriter structure
+ * A writer thread and its buffers. The ring holds at most one entry per
+ * buffer: when every buffer is waiting to be written, the rendering
+ * waits for the writer (backpressure). One thread renders through it
+ * at a time, but it can be kept for any number of renderings.
+*/
+typedef struct {
+	// The sink the writer thread calls, like .write.
+	int (*write) (const char* data, size_t length, void* userData);
+	void* userData;
+	size_t depth; // Number of buffers
+	size_t bufferSize;
+	char* memory;
+	CTML_AsyncEntry* entries; // The ring, of depth entries
+	atomic_size_t head; // Next entry to write, only moved by the writer
+	atomic_size_t tail; // Next entry to fill, only moved by the renderer
+	atomic_int failed; // Set when the sink failed
+	atomic_int stop;
+	// Only used to sleep when the ring is empty or full.
+	atomic_int writerWaiting;
+	atomic_int rendererWaiting;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t space;
+	pthread_t thread;
+	// Renderer side
+	CTML_Context* ctx;
+	char* current; // Buffer of ctx, NULL if none
+	char** freeBuffers;
+	size_t freeCount;
+	size_t reclaimed; // Entries whose buffer went back to freeBuffers
+} CTML_AsyncWriter;
+
+int ctml_async_init(CTML_AsyncWriter* writer, size_t depth, size_t bufferSize,
+                    int (*write) (const char* data, size_t length, void* userData), void* userData);
+void ctml_async_free(CTML_AsyncWriter* writer);
+int ctml_async_write(const char* data, size_t length, void* userData);
+void ctml_async_begin(CTML_AsyncWriter* writer, CTML_Context* ctx);
+void ctml_async_end(CTML_AsyncWriter* writer, CTML_Context* ctx);
+int ctml_async_wait(CTML_AsyncWriter* writer);
+
+// Like ctml(), with the same arguments (but the sink): the HTML goes
+// to the sink of writer, from its thread. The block returns once the
+// last buffer was handed to the writer (see ctml_async_wait).
+#define ctml_async(writer, ...)                                                                     \
+	CTML_Context ctml_context = (CTML_Context) {.write = ctml_async_write, .userData = (writer), __VA_ARGS__}; \
+	CTML_Context* CTML_CTX_NAME = &ctml_context;                                                 \
+	ctml_async_begin(writer, CTML_CTX_NAME);                                                     \
+	for (int _once = 0; _once < 1; _once = 1, ctml_async_end(writer, CTML_CTX_NAME))
+
+
+#ifdef CTML_IMPLEMENTATION
+
+// The writer thread.
+static void* ctml_async_run(void* arg) {
+	CTML_AsyncWriter* writer = arg;
+	for (;;) {
+		size_t head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+		if (head == atomic_load(&writer->tail)) {
+			// Everything queued is written before stopping.
+			if (atomic_load(&writer->stop)) break;
+			pthread_mutex_lock(&writer->lock);
+			atomic_store(&writer->writerWaiting, 1);
+			while (head == atomic_load(&writer->tail) && !atomic_load(&writer->stop)) {
+				pthread_cond_wait(&writer->wake, &writer->lock);
+			}
+			atomic_store(&writer->writerWaiting, 0);
+			pthread_mutex_unlock(&writer->lock);
+			continue;
+		}
+		CTML_AsyncEntry* entry = &writer->entries[head % writer->depth];
+		// After a failure, buffers are dropped (but still given back).
+		if (!atomic_load_explicit(&writer->failed, memory_order_relaxed) &&
+		    writer->write(entry->data, entry->length, writer->userData) != 0) {
+			atomic_store(&writer->failed, 1);
+		}
+		atomic_store(&writer->head, head + 1);
+		if (atomic_load(&writer->rendererWaiting)) {
+			pthread_mutex_lock(&writer->lock);
+			pthread_cond_signal(&writer->space);
+			pthread_mutex_unlock(&writer->lock);
+		}
+	}
+	return NULL;
+}
+
+// Returns 0, or -1 if the thread or the buffers could not be created.
+int ctml_async_init(CTML_AsyncWriter* writer, size_t depth, size_t bufferSize,
+                    int (*write) (const char* data, size_t length, void* userData), void* userData) {
+	*writer = (CTML_AsyncWriter){.write = write, .userData = userData, .depth = depth, .bufferSize = bufferSize};
+	if (depth < 2 || bufferSize < 2) return -1;
+	writer->memory = CTML_MALLOC(depth * bufferSize);
+	writer->entries = CTML_MALLOC(depth * sizeof(CTML_AsyncEntry));
+	writer->freeBuffers = CTML_MALLOC(depth * sizeof(char*));
+	if (writer->memory == NULL || writer->entries == NULL || writer->freeBuffers == NULL) {
+		goto error;
+	}
+	for (size_t i = 0; i < depth; i++) {
+		writer->freeBuffers[i] = writer->memory + i * bufferSize;
+	}
+	writer->freeCount = depth;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->wake, NULL);
+	pthread_cond_init(&writer->space, NULL);
+	if (pthread_create(&writer->thread, NULL, ctml_async_run, writer) != 0) {
+		pthread_cond_destroy(&writer->space);
+		pthread_cond_destroy(&writer->wake);
+		pthread_mutex_destroy(&writer->lock);
+		goto error;
+	}
+	return 0;
+error:
+	CTML_FREE(writer->memory);
+	CTML_FREE(writer->entries);
+	CTML_FREE(writer->freeBuffers);
+	*writer = (CTML_AsyncWriter){0};
+	return -1;
+}
+
+// Writes what is still queued, then stops the thread.
+void ctml_async_free(CTML_AsyncWriter* writer) {
+	if (writer->memory == NULL) return;
+	atomic_store(&writer->stop, 1);
+	pthread_mutex_lock(&writer->lock);
+	pthread_cond_signal(&writer->wake);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+	pthread_cond_destroy(&writer->space);
+	pthread_cond_destroy(&writer->wake);
+	pthread_mutex_destroy(&writer->lock);
+	CTML_FREE(writer->memory);
+	CTML_FREE(writer->entries);
+	CTML_FREE(writer->freeBuffers);
+	*writer = (CTML_AsyncWriter){0};
+}
+
+// Sleeps until the writer moved head past seen.
+static void ctml_async_wait_head(CTML_AsyncWriter* writer, size_t seen) {
+	pthread_mutex_lock(&writer->lock);
+	atomic_store(&writer->rendererWaiting, 1);
+	while (atomic_load(&writer->head) == seen) {
+		pthread_cond_wait(&writer->space, &writer->lock);
+	}
+	atomic_store(&writer->rendererWaiting, 0);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+// Returns a free buffer, waiting for the writer if there is none.
+static char* ctml_async_take(CTML_AsyncWriter* writer) {
+	for (;;) {
+		size_t head = atomic_load_explicit(&writer->head, memory_order_acquire);
+		while (writer->reclaimed != head) {
+			writer->freeBuffers[writer->freeCount++] = writer->entries[writer->reclaimed % writer->depth].buffer;
+			writer->reclaimed++;
+		}
+		if (writer->freeCount != 0) {
+			return writer->freeBuffers[--writer->freeCount];
+		}
+		ctml_async_wait_head(writer, head);
+	}
+}
+
+// Hands data (in buffer) to the writer thread. The ring cannot be
+// full: every entry holds a different buffer.
+static void ctml_async_push(CTML_AsyncWriter* writer, char* buffer, const char* data, size_t length) {
+	size_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+	writer->entries[tail % writer->depth] = (CTML_AsyncEntry){buffer, data, length};
+	atomic_store(&writer->tail, tail + 1);
+	if (atomic_load(&writer->writerWaiting)) {
+		pthread_mutex_lock(&writer->lock);
+		pthread_cond_signal(&writer->wake);
+		pthread_mutex_unlock(&writer->lock);
+	}
+}
+
+// The sink of ctml_async.
+int ctml_async_write(const char* data, size_t length, void* userData) {
+	CTML_AsyncWriter* writer = userData;
+	CTML_Context* ctx = writer->ctx;
+	// Not initialized, or the sink failed.
+	if (writer->memory == NULL || atomic_load_explicit(&writer->failed, memory_order_relaxed)) return -1;
+	char* current = writer->current;
+	if (current != NULL && data >= current && data + length <= current + writer->bufferSize) {
+		// The buffer of the context is handed as it is, and the
+		// rendering goes on in another one.
+		ctml_async_push(writer, current, data, length);
+		char* next = ctml_async_take(writer);
+		writer->current = next;
+		ctx->buffer = next + (ctx->buffer - current); // Keeps the room of .chunked
+		ctx->outputBuffer = next;
+		return 0;
+	}
+	// Anything else (codec output, chunk ends, big writes) may not
+	// outlive this call, so it is copied.
+	while (length > 0) {
+		char* buffer = ctml_async_take(writer);
+		size_t n = length < writer->bufferSize ? length : writer->bufferSize;
+		ctml_memcpy(buffer, data, n);
+		ctml_async_push(writer, buffer, buffer, n);
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+void ctml_async_begin(CTML_AsyncWriter* writer, CTML_Context* ctx) {
+	writer->ctx = ctx;
+	if (writer->memory != NULL) {
+		writer->current = ctml_async_take(writer);
+		ctx->outputBuffer = writer->current;
+		ctx->outputBufferSize = writer->bufferSize;
+	}
+	ctml_begin(ctx);
+}
+
+// The last buffer is handed to the writer by ctml_end.
+void ctml_async_end(CTML_AsyncWriter* writer, CTML_Context* ctx) {
+	ctml_end(ctx);
+	ctx->outputBuffer = NULL;
+	if (writer->current != NULL) {
+		writer->freeBuffers[writer->freeCount++] = writer->current;
+		writer->current = NULL;
+	}
+}
+
+// Waits until everything handed to the writer was written. Returns
+// 0, or -1 if the sink failed since the last call (the failure is
+// then cleared).
+int ctml_async_wait(CTML_AsyncWriter* writer) {
+	if (writer->memory == NULL) return -1;
+	size_t tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+	size_t head;
+	while ((head = atomic_load(&writer->head)) != tail) {
+		ctml_async_wait_head(writer, head);
+	}
+	return atomic_exchange(&writer->failed, 0) ? -1 : 0;
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_ASYNC_H
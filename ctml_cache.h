@@ -0,0 +1,415 @@
+/*
+ * ctml_cache.h
+ * * Fragment cache for ctml: the HTML generated inside of a
+ * * ctml_cached(key, ttl) block is kept on the first render and
+ * * copied as it is on the next ones, without running the block.
+ * * Needs libc, C11 atomics and pthreads. Include it after ctml.h
+ * * (the implementation is enabled by CTML_IMPLEMENTATION as well).
+ * * Example:
+ * ctml_cached("footer", 60) {
+ *     footer(.class="main") { ... }
+ * }
+ */
+
+#ifndef CTML_CACHE_H
+#define CTML_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Number of buckets of the hash table of a cache.
+#ifndef CTML_CACHE_BUCKETS
+	#define CTML_CACHE_BUCKETS 256
+#endif
+
+// Memory cap of ctml_default_cache (keys, HTML and entries).
+#ifndef CTML_CACHE_MAX_BYTES
+	#define CTML_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#endif
+
+// Number of reader slots of a cache. Every thread uses one of them,
+// so that hits do not all write the same cache line.
+#ifndef CTML_CACHE_READER_SLOTS
+	#define CTML_CACHE_READER_SLOTS 16
+#endif
+
+typedef struct CTML_CacheEntry {
+	struct CTML_CacheEntry* _Atomic next;
+	struct CTML_CacheEntry* retiredNext;
+	uint64_t hash;
+	uint64_t expires; // In ms (see ctml_cache_now), 0 if it never expires
+	_Atomic uint64_t lastUsed; // In ms, for the LRU
+	atomic_size_t references; // Hits copying its HTML
+	size_t length;
+	size_t bytes; // Memory used by this entry
+	char* data;
+	char key[];
+} CTML_CacheEntry;
+
+// Readers looking up an entry, and hits, of the threads using a slot.
+typedef struct {
+	_Alignas(64) atomic_size_t readers;
+	atomic_ullong hits;
+} CTML_CacheSlot;
+
+/*
+ * CTML_Cache structure
+ * Readers (ctml_cached) never take the lock: entries are immutable and only
+ * linked/unlinked atomically by writers, which hold the lock. A reader only
+ * counts in its slot while it looks an entry up and takes a reference on it,
+ * and only holds the reference while copying the HTML (never while calling
+ * a sink). Unlinked entries are retired, and freed once they have no reader
+ * and no reference anymore.
+*/
+typedef struct {
+	CTML_CacheEntry* _Atomic buckets[CTML_CACHE_BUCKETS];
+	CTML_CacheSlot slots[CTML_CACHE_READER_SLOTS];
+	pthread_mutex_t lock;
+	size_t maxBytes; // 0 means no limit
+	size_t bytes; // Linked entries, protected by lock
+	size_t retiredBytes; // Retired entries not freed yet, protected by lock
+	CTML_CacheEntry* retired; // Protected by lock
+	atomic_size_t retiredCount;
+	atomic_ullong misses;
+	atomic_ullong evictions;
+} CTML_Cache;
+
+#define CTML_CACHE_INIT(max_bytes) {.lock = PTHREAD_MUTEX_INITIALIZER, .maxBytes = (max_bytes)}
+
+extern CTML_Cache ctml_default_cache;
+
+// State of a ctml_cached block. On a miss, the block is rendered
+// in context (backed by arena) and then stored in the cache.
+typedef struct {
+	CTML_Cache* cache;
+	const char* key;
+	int ttl;
+	CTML_Context* parent;
+	int state;
+	CTML_Arena arena;
+	CTML_Context* context;
+} CTML_CacheCapture;
+
+int ctml_cache_begin(CTML_CacheCapture* capture);
+void ctml_cache_end(CTML_CacheCapture* capture);
+void ctml_cache_invalidate(CTML_Cache* cache, const char* key);
+void ctml_cache_clear(CTML_Cache* cache);
+uint64_t ctml_cache_hits(CTML_Cache* cache);
+
+// Caches the HTML generated inside of the block under key (a string),
+// for ttl seconds (0 means until it is invalidated or evicted).
+// In pretty mode, the indentation is the one of the first render.
+// NOTE: like h(), the block must not be left with break/return/goto.
+#define ctml_cached_in(c, k, t)                                                              \
+	for (CTML_CacheCapture _capture = {.cache = (c), .key = (k), .ttl = (t), .parent = CTML_CTX_NAME}; \
+	     ctml_cache_begin(&_capture); ctml_cache_end(&_capture))                             \
+	for (CTML_Context* CTML_CTX_NAME = _capture.context; CTML_CTX_NAME; CTML_CTX_NAME = NULL)
+
+#define ctml_cached(k, t) ctml_cached_in(&ctml_default_cache, k, t)
+
+
+#ifdef CTML_IMPLEMENTATION
+
+#include <time.h>
+
+CTML_Cache ctml_default_cache = CTML_CACHE_INIT(CTML_CACHE_MAX_BYTES);
+
+enum {
+	CTML_CACHE_LOOKUP,
+	CTML_CACHE_RENDERING,
+	CTML_CACHE_DONE,
+};
+
+static uint64_t ctml_cache_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static uint64_t ctml_cache_hash(const char* key) {
+	uint64_t hash = 14695981039346656037ULL;
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static CTML_CacheEntry* _Atomic* ctml_cache_bucket(CTML_Cache* cache, uint64_t hash) {
+	return &cache->buckets[hash % CTML_CACHE_BUCKETS];
+}
+
+// Slot of the current thread.
+static CTML_CacheSlot* ctml_cache_slot(CTML_Cache* cache) {
+	static atomic_uint next;
+	static _Thread_local unsigned index; // Index + 1, 0 until it is picked
+	if (index == 0) {
+		index = atomic_fetch_add_explicit(&next, 1, memory_order_relaxed) % CTML_CACHE_READER_SLOTS + 1;
+	}
+	return &cache->slots[index - 1];
+}
+
+static CTML_CacheEntry* ctml_cache_find(CTML_Cache* cache, uint64_t hash, const char* key) {
+	// Those loads must not happen before readers is incremented (see
+	// ctml_cache_collect), hence the (default) sequentially consistent order.
+	CTML_CacheEntry* entry = atomic_load(ctml_cache_bucket(cache, hash));
+	while (entry != NULL) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+		entry = atomic_load(&entry->next);
+	}
+	return NULL;
+}
+
+// Frees the retired entries no reader can still use.
+// Called with the lock held.
+static void ctml_cache_collect(CTML_Cache* cache) {
+	// A reader that did not take its reference yet may still have found
+	// any of them. The ones starting now cannot find them anymore.
+	for (size_t i = 0; i < CTML_CACHE_READER_SLOTS; i++) {
+		if (atomic_load(&cache->slots[i].readers) != 0) return;
+	}
+	CTML_CacheEntry** link = &cache->retired;
+	while (*link != NULL) {
+		CTML_CacheEntry* entry = *link;
+		if (atomic_load(&entry->references) != 0) {
+			link = &entry->retiredNext;
+			continue;
+		}
+		*link = entry->retiredNext;
+		cache->retiredBytes -= entry->bytes;
+		atomic_fetch_sub(&cache->retiredCount, 1);
+		CTML_FREE(entry->data);
+		CTML_FREE(entry);
+	}
+}
+
+// Unlinks entry from its bucket. Called with the lock held.
+static void ctml_cache_unlink(CTML_Cache* cache, CTML_CacheEntry* entry) {
+	CTML_CacheEntry* _Atomic* link = ctml_cache_bucket(cache, entry->hash);
+	CTML_CacheEntry* current;
+	while ((current = atomic_load(link)) != NULL) {
+		if (current == entry) {
+			atomic_store(link, atomic_load(&entry->next));
+			cache->bytes -= entry->bytes;
+			cache->retiredBytes += entry->bytes;
+			entry->retiredNext = cache->retired;
+			cache->retired = entry;
+			atomic_fetch_add(&cache->retiredCount, 1);
+			return;
+		}
+		link = &current->next;
+	}
+}
+
+// Evicts the least recently used entries until size more bytes fit.
+// Only linked entries are counted: retired ones are freed as soon as the
+// threads copying them are done, evicting more would not free them sooner.
+// Called with the lock held.
+static void ctml_cache_evict(CTML_Cache* cache, size_t size) {
+	while (cache->bytes + size > cache->maxBytes) {
+		CTML_CacheEntry* oldest = NULL;
+		for (size_t i = 0; i < CTML_CACHE_BUCKETS; i++) {
+			CTML_CacheEntry* entry = atomic_load(&cache->buckets[i]);
+			for (; entry != NULL; entry = atomic_load(&entry->next)) {
+				if (oldest == NULL || atomic_load(&entry->lastUsed) < atomic_load(&oldest->lastUsed)) {
+					oldest = entry;
+				}
+			}
+		}
+		if (oldest == NULL) return;
+		ctml_cache_unlink(cache, oldest);
+		atomic_fetch_add(&cache->evictions, 1);
+	}
+}
+
+// Stores the rendered HTML (taking the memory of the arena).
+static void ctml_cache_store(CTML_Cache* cache, const char* key, int ttl, CTML_Arena* arena) {
+	size_t key_length = strlen(key);
+	size_t bytes = sizeof(CTML_CacheEntry) + key_length + 1 + arena->length + 1;
+	if (arena->failed || (cache->maxBytes != 0 && bytes > cache->maxBytes)) {
+		return;
+	}
+	CTML_CacheEntry* entry = CTML_MALLOC(sizeof(CTML_CacheEntry) + key_length + 1);
+	if (entry == NULL) return;
+	// Gives back what the arena did not use.
+	char* data = CTML_REALLOC(arena->data, arena->length + 1);
+	if (data != NULL) {
+		arena->data = data;
+	}
+	memcpy(entry->key, key, key_length + 1);
+	entry->hash = ctml_cache_hash(key);
+	entry->expires = ttl > 0 ? ctml_cache_now() + (uint64_t)ttl * 1000 : 0;
+	atomic_init(&entry->lastUsed, ctml_cache_now());
+	atomic_init(&entry->references, 0);
+	entry->length = arena->length;
+	entry->bytes = bytes;
+	entry->data = arena->data;
+	arena->data = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	ctml_cache_collect(cache);
+	// Retired entries may briefly take the memory over maxBytes, but
+	// nothing is stored (or evicted) while they alone reach it.
+	if (cache->maxBytes != 0 && cache->retiredBytes >= cache->maxBytes) {
+		pthread_mutex_unlock(&cache->lock);
+		CTML_FREE(entry->data);
+		CTML_FREE(entry);
+		return;
+	}
+	// Another thread may have rendered it at the same time.
+	CTML_CacheEntry* previous = ctml_cache_find(cache, entry->hash, key);
+	if (previous != NULL) {
+		ctml_cache_unlink(cache, previous);
+	}
+	if (cache->maxBytes != 0) {
+		ctml_cache_evict(cache, bytes);
+	}
+	CTML_CacheEntry* _Atomic* bucket = ctml_cache_bucket(cache, entry->hash);
+	atomic_init(&entry->next, atomic_load(bucket));
+	atomic_store_explicit(bucket, entry, memory_order_release);
+	cache->bytes += bytes;
+	ctml_cache_collect(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Returns the entry of key with a reference on it,
+// NULL if there is none (or if it expired).
+static CTML_CacheEntry* ctml_cache_acquire(CTML_Cache* cache, CTML_CacheSlot* slot, uint64_t hash, const char* key, uint64_t now) {
+	atomic_fetch_add(&slot->readers, 1);
+	CTML_CacheEntry* entry = ctml_cache_find(cache, hash, key);
+	if (entry != NULL && (entry->expires == 0 || now < entry->expires)) {
+		atomic_fetch_add(&entry->references, 1);
+	} else {
+		entry = NULL;
+	}
+	atomic_fetch_sub(&slot->readers, 1);
+	return entry;
+}
+
+// The entry must not be used anymore once this is called.
+static void ctml_cache_release(CTML_Cache* cache, CTML_CacheEntry* entry) {
+	atomic_fetch_sub(&entry->references, 1);
+	if (atomic_load(&cache->retiredCount) != 0) {
+		pthread_mutex_lock(&cache->lock);
+		ctml_cache_collect(cache);
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+
+// Whether length bytes can be written to ctx without calling its sink.
+static int ctml_cache_fits(CTML_Context* ctx, size_t length) {
+	return ctx->arena != NULL || length <= ctx->bufferCapacity - ctx->bufferedDataLength;
+}
+
+int ctml_cache_begin(CTML_CacheCapture* capture) {
+	if (capture->state != CTML_CACHE_LOOKUP || capture->parent->failed) {
+		return 0;
+	}
+	CTML_Cache* cache = capture->cache;
+	CTML_Context* parent = capture->parent;
+	CTML_CacheSlot* slot = ctml_cache_slot(cache);
+	uint64_t hash = ctml_cache_hash(capture->key);
+	uint64_t now = ctml_cache_now();
+	CTML_CacheEntry* entry = ctml_cache_acquire(cache, slot, hash, capture->key, now);
+	if (entry != NULL && !ctml_cache_fits(parent, entry->length) && entry->length <= parent->bufferCapacity) {
+		// It fits once the buffer is flushed, which is done without
+		// holding the entry (the sink may block).
+		ctml_cache_release(cache, entry);
+		ctml_flush_buffer(parent);
+		entry = ctml_cache_acquire(cache, slot, hash, capture->key, now);
+	}
+	if (entry != NULL) {
+		if (atomic_load_explicit(&entry->lastUsed, memory_order_relaxed) != now) {
+			atomic_store_explicit(&entry->lastUsed, now, memory_order_relaxed);
+		}
+		int hit = 1;
+		char* copy = NULL;
+		size_t length = entry->length;
+		if (ctml_cache_fits(parent, length)) {
+			ctml_write(parent, entry->data, length);
+		} else {
+			// Bigger than the buffer: copied first, then written.
+			copy = CTML_MALLOC(length);
+			if (copy != NULL) {
+				memcpy(copy, entry->data, length);
+			} else {
+				hit = 0;
+			}
+		}
+		ctml_cache_release(cache, entry);
+		if (hit) {
+			if (copy != NULL) {
+				ctml_write(parent, copy, length);
+				CTML_FREE(copy);
+			}
+			atomic_fetch_add_explicit(&slot->hits, 1, memory_order_relaxed);
+			capture->state = CTML_CACHE_DONE;
+			return 0;
+		}
+		// Out of memory: rendered instead.
+	}
+	atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+	// Only allocated on misses, so that hits stay cheap.
+	capture->state = CTML_CACHE_RENDERING;
+	capture->context = CTML_MALLOC(sizeof(CTML_Context));
+	if (capture->context == NULL) {
+		// Rendered without being cached.
+		capture->context = capture->parent;
+		return 1;
+	}
+	*capture->context = (CTML_Context){.arena = &capture->arena, .indent = capture->parent->indent};
+	// Small fragments should not take a whole CTML_ARENA_CHUNK.
+	ctml_arena_reserve(&capture->arena, 256);
+	ctml_begin(capture->context);
+	return 1;
+}
+
+void ctml_cache_end(CTML_CacheCapture* capture) {
+	capture->state = CTML_CACHE_DONE;
+	if (capture->context == capture->parent) return;
+	ctml_flush_buffer(capture->context);
+	CTML_FREE(capture->context);
+	ctml_write(capture->parent, capture->arena.data, capture->arena.length);
+	ctml_cache_store(capture->cache, capture->key, capture->ttl, &capture->arena);
+	ctml_arena_free(&capture->arena);
+}
+
+void ctml_cache_invalidate(CTML_Cache* cache, const char* key) {
+	pthread_mutex_lock(&cache->lock);
+	CTML_CacheEntry* entry = ctml_cache_find(cache, ctml_cache_hash(key), key);
+	if (entry != NULL) {
+		ctml_cache_unlink(cache, entry);
+	}
+	ctml_cache_collect(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Hits of all the threads.
+uint64_t ctml_cache_hits(CTML_Cache* cache) {
+	uint64_t hits = 0;
+	for (size_t i = 0; i < CTML_CACHE_READER_SLOTS; i++) {
+		hits += atomic_load_explicit(&cache->slots[i].hits, memory_order_relaxed);
+	}
+	return hits;
+}
+
+void ctml_cache_clear(CTML_Cache* cache) {
+	pthread_mutex_lock(&cache->lock);
+	for (size_t i = 0; i < CTML_CACHE_BUCKETS; i++) {
+		CTML_CacheEntry* entry;
+		while ((entry = atomic_load(&cache->buckets[i])) != NULL) {
+			ctml_cache_unlink(cache, entry);
+		}
+	}
+	ctml_cache_collect(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_CACHE_H
@@ -0,0 +1,163 @@
+/*
+ * ctml_deflate.h
+ * * zlib compression stage for ctml: the HTML is compressed (gzip, zlib
+ * * or raw deflate) between the buffer and the sink. Needs zlib (-lz).
+ * * Include it after ctml.h (the implementation is enabled by
+ * * CTML_IMPLEMENTATION as well).
+ * * Example:
+ * static _Thread_local CTML_Deflate gzip = CTML_DEFLATE_INIT(6, CTML_DEFLATE_GZIP, CTML_DEFLATE_FLUSH_BUFFER);
+ * ctml(.write = socket_sink, .codec = &gzip.codec) { ... }
+ */
+
+#ifndef CTML_DEFLATE_H
+#define CTML_DEFLATE_H
+
+#include <zlib.h>
+
+// Size of the output buffer of a CTML_Deflate.
+#ifndef CTML_DEFLATE_BUFSIZE
+	#define CTML_DEFLATE_BUFSIZE 16384
+#endif
+
+// Formats
+enum {
+	CTML_DEFLATE_GZIP, // Content-Encoding: gzip
+	CTML_DEFLATE_ZLIB, // Content-Encoding: deflate
+	CTML_DEFLATE_RAW,
+};
+
+// Flush policies
+enum {
+	// Compressed data is kept in the output buffer across flushes of the
+	// ctml buffer, and sent when it is full, on ctml_flush and at the end
+	// of ctml(). Best ratio and fewest sink calls, but nothing is sent
+	// before CTML_DEFLATE_BUFSIZE compressed bytes are produced.
+	CTML_DEFLATE_FLUSH_END,
+	// Every flush of the ctml buffer is compressed and sent right away
+	// (Z_SYNC_FLUSH), so pages keep streaming. Costs a few bytes per flush.
+	CTML_DEFLATE_FLUSH_BUFFER,
+};
+
+/*
+ * CTML_Deflate structure
+ * The zlib state is allocated on first use and reset (not freed) at the
+ * end of every rendering, so a CTML_Deflate kept per thread does not
+ * allocate anymore. It must not be used by two renderings at once.
+*/
+typedef struct {
+	CTML_Codec codec;
+	int level; // 0 to 9, or Z_DEFAULT_COMPRESSION
+	int format;
+	int flush;
+	int initialized;
+	z_stream stream;
+	uint64_t bytesIn; // Totals of every rendering
+	uint64_t bytesOut;
+	size_t outLength; // Compressed bytes waiting in out
+	unsigned char out[CTML_DEFLATE_BUFSIZE];
+} CTML_Deflate;
+
+int ctml_deflate_encode(CTML_Codec* codec, CTML_Context* ctx, const char* data, size_t length, int mode);
+void ctml_deflate_free(CTML_Deflate* state);
+
+#define CTML_DEFLATE_INIT(l, fmt, f) {.codec = {ctml_deflate_encode}, .level = (l), .format = (fmt), .flush = (f)}
+
+
+#ifdef CTML_IMPLEMENTATION
+
+// zlib allocates through CTML_MALLOC as well.
+static voidpf ctml_deflate_alloc(voidpf opaque, uInt items, uInt size) {
+	(void)opaque;
+	return CTML_MALLOC((size_t)items * size);
+}
+
+static void ctml_deflate_dealloc(voidpf opaque, voidpf address) {
+	(void)opaque;
+	CTML_FREE(address);
+}
+
+// Sends what waits in the output buffer.
+static void ctml_deflate_send(CTML_Deflate* state, CTML_Context* ctx) {
+	if (state->outLength != 0) {
+		state->bytesOut += state->outLength;
+		ctml_codec_output(ctx, (const char*)state->out, state->outLength);
+		state->outLength = 0;
+	}
+}
+
+int ctml_deflate_encode(CTML_Codec* codec, CTML_Context* ctx, const char* data, size_t length, int mode) {
+	CTML_Deflate* state = (CTML_Deflate*)codec;
+	z_stream* stream = &state->stream;
+	if (ctx->failed) {
+		// Nothing can be sent anymore, but the state is reset
+		// for the next rendering.
+		if (mode == CTML_CODEC_FINISH && state->initialized) {
+			deflateReset(stream);
+		}
+		state->outLength = 0;
+		return 0;
+	}
+	if (!state->initialized) {
+		int bits = state->format == CTML_DEFLATE_GZIP ? 15 + 16 : state->format == CTML_DEFLATE_RAW ? -15 : 15;
+		stream->zalloc = ctml_deflate_alloc;
+		stream->zfree = ctml_deflate_dealloc;
+		stream->opaque = Z_NULL;
+		if (deflateInit2(stream, state->level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return -1;
+		}
+		state->initialized = 1;
+	}
+
+	int flush = Z_NO_FLUSH;
+	if (mode == CTML_CODEC_FINISH) {
+		flush = Z_FINISH;
+	} else if (mode == CTML_CODEC_FLUSH || state->flush == CTML_DEFLATE_FLUSH_BUFFER) {
+		flush = Z_SYNC_FLUSH;
+	}
+	state->bytesIn += length;
+	do {
+		// avail_in is an uInt, bigger writes are given in several steps.
+		uInt step = length > (1u << 30) ? (1u << 30) : (uInt)length;
+		stream->next_in = (Bytef*)data;
+		stream->avail_in = step;
+		if (step != 0) {
+			data += step;
+			length -= step;
+		}
+		int step_flush = length ? Z_NO_FLUSH : flush;
+		do {
+			// The output buffer is filled across calls, and only
+			// sent when full or when flushing.
+			stream->next_out = state->out + state->outLength;
+			stream->avail_out = (uInt)(sizeof(state->out) - state->outLength);
+			if (deflate(stream, step_flush) == Z_STREAM_ERROR) {
+				return -1;
+			}
+			state->outLength = sizeof(state->out) - stream->avail_out;
+			if (stream->avail_out == 0) {
+				ctml_deflate_send(state, ctx);
+				if (ctx->failed) return 0;
+			}
+		} while (stream->avail_out == 0);
+	} while (length != 0);
+	if (flush != Z_NO_FLUSH) {
+		ctml_deflate_send(state, ctx);
+	}
+
+	if (mode == CTML_CODEC_FINISH) {
+		// Ready for the next rendering, without allocating.
+		deflateReset(stream);
+	}
+	return 0;
+}
+
+void ctml_deflate_free(CTML_Deflate* state) {
+	if (state->initialized) {
+		deflateEnd(&state->stream);
+		state->initialized = 0;
+	}
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_DEFLATE_H
@@ -0,0 +1,261 @@
+/*
+ * ctml_live.h
+ * * Incremental rendering for ctml: the elements with an id rendered
+ * * inside of a ctml_live block are tracked across renders, and only
+ * * the ones that changed are sent again, as out-of-band swaps (htmx
+ * * hx-swap-oob by default). Needs libc. Include it after ctml.h
+ * * (the implementation is enabled by CTML_IMPLEMENTATION as well).
+ * * Example:
+ * static CTML_Live view; // One per client, kept between renders
+ * ctml_live(&view, .write = sse_sink, .userData = client) {
+ *     dashboard(ctx);
+ * }
+ */
+
+#ifndef CTML_LIVE_H
+#define CTML_LIVE_H
+
+// Attribute added to the elements sent by a partial render.
+#ifndef CTML_LIVE_OOB
+	#define CTML_LIVE_OOB " hx-swap-oob=\"true\""
+#endif
+
+// An element with an id, offsets are in the arena.
+typedef struct {
+	size_t start;
+	size_t nameEnd; // After "<name", where CTML_LIVE_OOB goes
+	size_t end;
+	size_t next; // Index of the element following this subtree
+	size_t parent; // Index + 1 of the tracked parent, 0 if none
+	uint64_t id; // Hash of the id
+	uint64_t hash; // Hash of its HTML, with tracked children replaced by their id
+	int depth;
+} CTML_LiveElement;
+
+typedef struct {
+	uint64_t id; // 0 when the slot is empty
+	uint64_t hash;
+} CTML_LiveSlot;
+
+/*
+ * CTML_Live structure
+ * State of a view across renders. A zeroed one is ready to be used, and
+ * its first render sends the whole page. Memory is kept between renders.
+*/
+typedef struct {
+	CTML_TagHook hook;
+	CTML_Arena arena; // The HTML of the last render
+	CTML_LiveElement* elements;
+	size_t count;
+	size_t capacity;
+	size_t current; // Index + 1 of the innermost open element, 0 if none
+	int depth;
+	int overflow; // Set when elements could not be allocated
+	// Hashes of the last render, by id (open addressing).
+	CTML_LiveSlot* slots;
+	size_t slotCount; // Power of 2
+	uint64_t root; // Hash of the HTML outside of the tracked elements
+	int rendered; // Set once a render was sent
+	int full; // Set when the last render sent the whole page
+	size_t sent; // Elements sent by the last render, if it was partial
+} CTML_Live;
+
+void ctml_live_begin(CTML_Live* live, CTML_Context* ctx);
+void ctml_live_end(CTML_Live* live, CTML_Context* output, CTML_Context* ctx);
+void ctml_live_reset(CTML_Live* live);
+void ctml_live_free(CTML_Live* live);
+
+// Like ctml(), with the same arguments: the block is rendered in
+// the arena of live, and then sent entirely (first render, or when what
+// changed is outside of the elements with an id), or only the elements
+// with an id whose HTML changed since the last render.
+// NOTE: ids must be unique, and elements rendered by ctml_task or copied
+// from ctml_cached are not tracked (they belong to their parent).
+#define ctml_live(live, ...)                                                                  \
+	CTML_Context ctml_context = (CTML_Context) {__VA_ARGS__};                              \
+	CTML_Context ctml_live_context = (CTML_Context) {.arena = &(live)->arena};            \
+	CTML_Context* CTML_CTX_NAME = &ctml_live_context;                                     \
+	ctml_live_begin(live, CTML_CTX_NAME);                                                 \
+	for (int _once = 0; _once < 1; _once = 1, ctml_live_end(live, &ctml_context, CTML_CTX_NAME))
+
+
+#ifdef CTML_IMPLEMENTATION
+
+// Returns the id given to tag, NULL if there is none.
+static const char* ctml_live_id(const CTML_Tag* tag) {
+	for (unsigned short i = 0; i < tag->count; i++) {
+		if ((tag->attributes[i] & ~CTML_ATTRIBUTE_ESCAPE) == CTML_ATTRIBUTE_INDEX(id)) {
+			return tag->values[i];
+		}
+	}
+	return NULL;
+}
+
+// Makes room for one more element.
+static int ctml_live_grow(CTML_Live* live) {
+	if (live->count < live->capacity) return 1;
+	size_t capacity = live->capacity ? live->capacity * 2 : 64;
+	CTML_LiveElement* elements = CTML_REALLOC(live->elements, capacity * sizeof(CTML_LiveElement));
+	if (elements == NULL) {
+		live->overflow = 1;
+		return 0;
+	}
+	live->elements = elements;
+	live->capacity = capacity;
+	return 1;
+}
+
+static void ctml_live_open(CTML_TagHook* hook, CTML_Context* ctx, const CTML_Tag* tag) {
+	CTML_Live* live = (CTML_Live*)hook;
+	const char* id = ctml_live_id(tag);
+	if (id != NULL && !live->overflow && ctml_live_grow(live)) {
+		uint64_t hash = ctml_hash(id, strlen(id), 0);
+		live->elements[live->count++] = (CTML_LiveElement){
+			.start = ctx->bufferedDataLength,
+			.nameEnd = ctx->bufferedDataLength + 1 + tag->tag_name_length,
+			.parent = live->current,
+			.id = hash ? hash : 1, // 0 marks empty slots
+			.depth = live->depth,
+		};
+		live->current = live->count;
+	}
+	if (!tag->self_close) {
+		live->depth++;
+	}
+}
+
+// Hashes the HTML from start to end, with the tracked elements
+// following first (until end) replaced by their id.
+static uint64_t ctml_live_hash(CTML_Live* live, const char* html, size_t first, size_t start, size_t end) {
+	CTML_Hash hash;
+	ctml_hash_reset(&hash, 0);
+	size_t i = first;
+	while (i < live->count && live->elements[i].start < end) {
+		CTML_LiveElement* child = &live->elements[i];
+		ctml_hash_update(&hash, html + start, child->start - start);
+		ctml_hash_update(&hash, &child->id, sizeof(child->id));
+		start = child->end;
+		i = child->next;
+	}
+	ctml_hash_update(&hash, html + start, end - start);
+	return ctml_hash_digest(&hash);
+}
+
+static void ctml_live_close(CTML_TagHook* hook, CTML_Context* ctx, const CTML_Tag* tag) {
+	CTML_Live* live = (CTML_Live*)hook;
+	if (!tag->self_close) {
+		live->depth--;
+	}
+	if (live->current == 0) return;
+	size_t index = live->current - 1;
+	CTML_LiveElement* element = &live->elements[index];
+	if (element->depth != live->depth) return;
+	element->end = ctx->bufferedDataLength;
+	element->next = live->count;
+	element->hash = ctml_live_hash(live, ctx->buffer, index + 1, element->start, element->end);
+	live->current = element->parent;
+}
+
+void ctml_live_begin(CTML_Live* live, CTML_Context* ctx) {
+	live->hook = (CTML_TagHook){ctml_live_open, ctml_live_close};
+	ctx->tagHook = &live->hook;
+	ctml_arena_reset(&live->arena);
+	live->count = 0;
+	live->current = 0;
+	live->depth = 0;
+	live->overflow = 0;
+	ctml_begin(ctx);
+}
+
+static CTML_LiveSlot* ctml_live_slot(CTML_Live* live, uint64_t id) {
+	size_t mask = live->slotCount - 1;
+	size_t i = id & mask;
+	while (live->slots[i].id != 0 && live->slots[i].id != id) {
+		i = (i + 1) & mask;
+	}
+	return &live->slots[i];
+}
+
+// Keeps the hashes of this render for the next one.
+static void ctml_live_store(CTML_Live* live) {
+	size_t wanted = 16;
+	while (wanted < live->count * 2) {
+		wanted *= 2;
+	}
+	if (wanted > live->slotCount) {
+		CTML_FREE(live->slots);
+		live->slots = CTML_MALLOC(wanted * sizeof(CTML_LiveSlot));
+		live->slotCount = live->slots ? wanted : 0;
+	}
+	if (live->slots == NULL) {
+		live->rendered = 0;
+		return;
+	}
+	memset(live->slots, 0, live->slotCount * sizeof(CTML_LiveSlot));
+	for (size_t i = 0; i < live->count; i++) {
+		CTML_LiveSlot* slot = ctml_live_slot(live, live->elements[i].id);
+		slot->id = live->elements[i].id;
+		slot->hash = live->elements[i].hash;
+	}
+}
+
+// Sends the page, or what changed in it, to output.
+void ctml_live_end(CTML_Live* live, CTML_Context* output, CTML_Context* ctx) {
+	ctml_end(ctx);
+	ctx->tagHook = NULL;
+	CTML_Arena* arena = &live->arena;
+	const char* html = arena->data;
+	// Elements left open (like after a failed allocation) are not usable.
+	int valid = !arena->failed && !live->overflow && live->current == 0;
+	uint64_t root = valid ? ctml_live_hash(live, html, 0, 0, arena->length) : 0;
+	int full = !valid || !live->rendered || root != live->root;
+
+	ctml_begin(output);
+	live->sent = 0;
+	if (full) {
+		ctml_write(output, html, arena->length);
+	} else {
+		size_t i = 0;
+		while (i < live->count) {
+			CTML_LiveElement* element = &live->elements[i];
+			CTML_LiveSlot* slot = ctml_live_slot(live, element->id);
+			if (slot->id == element->id && slot->hash == element->hash) {
+				i++;
+				continue;
+			}
+			// Its children are sent along with it.
+			ctml_write(output, html + element->start, element->nameEnd - element->start);
+			ctml_write_static(output, CTML_LIVE_OOB, sizeof(CTML_LIVE_OOB) - 1);
+			ctml_write(output, html + element->nameEnd, element->end - element->nameEnd);
+			#ifdef CTML_PRETTY
+				ctml_write_static(output, "\n", 1);
+			#endif
+			live->sent++;
+			i = element->next;
+		}
+	}
+	ctml_end(output);
+
+	live->full = full;
+	live->root = root;
+	live->rendered = valid && !output->failed;
+	if (live->rendered) {
+		ctml_live_store(live);
+	}
+}
+
+// The next render sends the whole page (like for a new client).
+void ctml_live_reset(CTML_Live* live) {
+	live->rendered = 0;
+}
+
+void ctml_live_free(CTML_Live* live) {
+	ctml_arena_free(&live->arena);
+	CTML_FREE(live->elements);
+	CTML_FREE(live->slots);
+	*live = (CTML_Live){0};
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_LIVE_H
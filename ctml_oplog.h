@@ -0,0 +1,383 @@
+/*
+ * ctml_oplog.h
+ * * Op-log for ctml: a template is run once and its tags, text and raw
+ * * output are recorded in a compact binary log, which can be stored and
+ * * replayed later in any style (compact, pretty, minified) without running
+ * * the template again. Include it after ctml.h (the implementation is
+ * * enabled by CTML_IMPLEMENTATION as well).
+ * * Example:
+ * CTML_OpLog log = {0};
+ * ctml_record(&log) { page(ctx); }
+ * ctml(.write = sink) {
+ *     ctml_oplog_replay(ctx, log.arena.data, log.arena.length, CTML_OPLOG_PRETTY);
+ * }
+ */
+
+#ifndef CTML_OPLOG_H
+#define CTML_OPLOG_H
+
+/*
+ * Ops, each starting with its type byte (integers are little endian):
+ * RAW   'r' u32 length, bytes
+ * TEXT  't' u32 length, bytes (not escaped yet)
+ * OPEN  'o' u8 self_close, u16 name length, name, u8 attribute count, and for
+ *       each attribute: u8 name length, name, u8 escape, u32 value length, value
+ * CLOSE 'c' u16 name length, name
+ * The log does not depend on the attributes known by ctml, so it can be
+ * replayed by programs using other CTML_CUSTOM_ATTRIBUTES.
+*/
+enum {
+	CTML_OP_RAW = 'r',
+	CTML_OP_TEXT = 't',
+	CTML_OP_OPEN = 'o',
+	CTML_OP_CLOSE = 'c',
+};
+
+// Replay styles
+enum {
+	CTML_OPLOG_COMPACT, // Like ctml without CTML_PRETTY
+	CTML_OPLOG_PRETTY, // A line per tag, and per text between two tags
+	CTML_OPLOG_MINIFIED, // Compact, with runs of whitespace in text collapsed
+};
+
+/*
+ * CTML_OpLog structure
+ * The log is in arena (data and length), it only contains bytes and
+ * can be copied or stored as it is. A zeroed one is ready to be used.
+*/
+typedef struct {
+	CTML_Recorder recorder;
+	CTML_Arena arena;
+	size_t rawHeader; // Offset of the header of the RAW op being written
+} CTML_OpLog;
+
+// An op read by ctml_oplog_next.
+typedef struct {
+	int type;
+	const char* name; // OPEN and CLOSE
+	size_t nameLength;
+	int selfClose;
+	int attributeCount;
+	const unsigned char* attributes; // Read with ctml_oplog_attribute
+	const char* data; // RAW and TEXT
+	size_t length;
+} CTML_Op;
+
+typedef struct {
+	const char* name;
+	size_t nameLength;
+	int escape;
+	const char* value;
+	size_t valueLength;
+} CTML_OpAttribute;
+
+void ctml_oplog_begin(CTML_OpLog* log, CTML_Context* ctx);
+void ctml_oplog_end(CTML_OpLog* log, CTML_Context* ctx);
+size_t ctml_oplog_next(const char* log, size_t length, size_t offset, CTML_Op* op);
+const unsigned char* ctml_oplog_attribute(const unsigned char* attributes, CTML_OpAttribute* attribute);
+void ctml_oplog_replay(CTML_Context* ctx, const char* log, size_t length, int style);
+void ctml_oplog_free(CTML_OpLog* log);
+
+// Runs the block once, recording it in log (replacing what it contained).
+// Like with ctml(), ctx can be given to components. Text and tags written
+// by other contexts (ctml_task, ctml_cached) are recorded as raw output.
+#define ctml_record(log)                                                                     \
+	CTML_Context ctml_context = (CTML_Context) {.arena = &(log)->arena};                  \
+	CTML_Context* CTML_CTX_NAME = &ctml_context;                                          \
+	ctml_oplog_begin(log, CTML_CTX_NAME);                                                 \
+	for (int _once = 0; _once < 1; _once = 1, ctml_oplog_end(log, CTML_CTX_NAME))
+
+
+#ifdef CTML_IMPLEMENTATION
+
+// Size of the header of RAW and TEXT ops.
+#define CTML_OP_HEADER 5
+
+// Name of an attribute, from its index.
+static const char* ctml_oplog_attribute_name(unsigned short index) {
+	switch (index) {
+		#define X(field)                          \
+			case CTML_ATTRIBUTE_INDEX(field): \
+				return #field;
+		#define XL(field, lname)                  \
+			case CTML_ATTRIBUTE_INDEX(field): \
+				return #lname;
+		ATTRIBUTES
+		#ifdef CTML_CUSTOM_ATTRIBUTES
+			CTML_CUSTOM_ATTRIBUTES
+		#endif
+		#undef X
+		#undef XL
+	}
+	return "";
+}
+
+static void ctml_oplog_put16(unsigned char* p, size_t value) {
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+}
+
+static void ctml_oplog_put32(unsigned char* p, size_t value) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+static size_t ctml_oplog_get16(const unsigned char* p) {
+	return (size_t)p[0] | (size_t)p[1] << 8;
+}
+
+static size_t ctml_oplog_get32(const unsigned char* p) {
+	return (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+}
+
+// Starts the RAW op receiving what is written next.
+static void ctml_oplog_start_raw(CTML_OpLog* log, CTML_Context* ctx) {
+	static const char header[CTML_OP_HEADER] = {CTML_OP_RAW};
+	log->rawHeader = ctx->bufferedDataLength;
+	ctml_write(ctx, header, sizeof(header));
+}
+
+// Ends the current RAW op, removing it when nothing was written.
+static void ctml_oplog_end_raw(CTML_OpLog* log, CTML_Context* ctx) {
+	size_t start = log->rawHeader + CTML_OP_HEADER;
+	if (ctx->bufferedDataLength < start || ctx->arena->failed) return;
+	size_t length = ctx->bufferedDataLength - start;
+	if (length == 0) {
+		ctx->bufferedDataLength = log->rawHeader;
+	} else if (length > 0xffffffffu) {
+		ctx->arena->failed = 1;
+	} else {
+		ctml_oplog_put32((unsigned char*)ctx->buffer + log->rawHeader + 1, length);
+	}
+}
+
+static void ctml_oplog_open(CTML_Recorder* recorder, CTML_Context* ctx, const CTML_Tag* tag) {
+	CTML_OpLog* log = (CTML_OpLog*)recorder;
+	ctml_oplog_end_raw(log, ctx);
+	unsigned char header[5] = {CTML_OP_OPEN, (unsigned char)tag->self_close};
+	ctml_oplog_put16(header + 2, tag->tag_name_length);
+	ctml_write(ctx, (const char*)header, 4);
+	ctml_write(ctx, tag->tag_name, tag->tag_name_length);
+	header[0] = (unsigned char)tag->count;
+	ctml_write(ctx, (const char*)header, 1);
+	for (unsigned short i = 0; i < tag->count; i++) {
+		const char* name = ctml_oplog_attribute_name(tag->attributes[i] & ~CTML_ATTRIBUTE_ESCAPE);
+		size_t name_length = ctml_strlen(name);
+		size_t value_length = ctml_strlen(tag->values[i]);
+		header[0] = (unsigned char)name_length;
+		ctml_write(ctx, (const char*)header, 1);
+		ctml_write(ctx, name, name_length);
+		header[0] = (tag->attributes[i] & CTML_ATTRIBUTE_ESCAPE) != 0;
+		ctml_oplog_put32(header + 1, value_length);
+		ctml_write(ctx, (const char*)header, 5);
+		ctml_write(ctx, tag->values[i], value_length);
+	}
+	ctml_oplog_start_raw(log, ctx);
+}
+
+static void ctml_oplog_close(CTML_Recorder* recorder, CTML_Context* ctx, const CTML_Tag* tag) {
+	CTML_OpLog* log = (CTML_OpLog*)recorder;
+	ctml_oplog_end_raw(log, ctx);
+	unsigned char header[3] = {CTML_OP_CLOSE};
+	ctml_oplog_put16(header + 1, tag->tag_name_length);
+	ctml_write(ctx, (const char*)header, 3);
+	ctml_write(ctx, tag->tag_name, tag->tag_name_length);
+	ctml_oplog_start_raw(log, ctx);
+}
+
+static void ctml_oplog_text(CTML_Recorder* recorder, CTML_Context* ctx, const char* text, size_t length) {
+	CTML_OpLog* log = (CTML_OpLog*)recorder;
+	ctml_oplog_end_raw(log, ctx);
+	while (length > 0) {
+		size_t n = length > 0xffffffffu ? 0xffffffffu : length;
+		unsigned char header[CTML_OP_HEADER] = {CTML_OP_TEXT};
+		ctml_oplog_put32(header + 1, n);
+		ctml_write(ctx, (const char*)header, sizeof(header));
+		ctml_write(ctx, text, n);
+		text += n;
+		length -= n;
+	}
+	ctml_oplog_start_raw(log, ctx);
+}
+
+void ctml_oplog_begin(CTML_OpLog* log, CTML_Context* ctx) {
+	log->recorder = (CTML_Recorder){ctml_oplog_open, ctml_oplog_close, ctml_oplog_text};
+	ctx->recorder = &log->recorder;
+	ctml_arena_reset(&log->arena);
+	ctml_begin(ctx);
+	ctml_oplog_start_raw(log, ctx);
+}
+
+void ctml_oplog_end(CTML_OpLog* log, CTML_Context* ctx) {
+	ctml_oplog_end_raw(log, ctx);
+	ctml_end(ctx);
+	ctx->recorder = NULL;
+}
+
+// Reads the op at offset. Returns the offset of the next one,
+// or 0 at the end of the log (or if it is truncated).
+size_t ctml_oplog_next(const char* log, size_t length, size_t offset, CTML_Op* op) {
+	const unsigned char* p = (const unsigned char*)log + offset;
+	size_t left = length - offset;
+	if (offset >= length) return 0;
+	*op = (CTML_Op){.type = p[0]};
+	switch (p[0]) {
+		case CTML_OP_RAW:
+		case CTML_OP_TEXT:
+			if (left < CTML_OP_HEADER) return 0;
+			op->length = ctml_oplog_get32(p + 1);
+			op->data = (const char*)p + CTML_OP_HEADER;
+			if (left - CTML_OP_HEADER < op->length) return 0;
+			return offset + CTML_OP_HEADER + op->length;
+		case CTML_OP_CLOSE:
+			if (left < 3) return 0;
+			op->nameLength = ctml_oplog_get16(p + 1);
+			op->name = (const char*)p + 3;
+			if (left - 3 < op->nameLength) return 0;
+			return offset + 3 + op->nameLength;
+		case CTML_OP_OPEN: {
+			if (left < 4) return 0;
+			op->selfClose = p[1];
+			op->nameLength = ctml_oplog_get16(p + 2);
+			op->name = (const char*)p + 4;
+			size_t used = 4 + op->nameLength;
+			if (left < used + 1) return 0;
+			op->attributeCount = p[used];
+			op->attributes = p + used + 1;
+			used++;
+			for (int i = 0; i < op->attributeCount; i++) {
+				if (left < used + 1 || left < used + 1 + p[used] + 5) return 0;
+				used += 1 + p[used];
+				size_t value_length = ctml_oplog_get32(p + used + 1);
+				used += 5;
+				if (left - used < value_length) return 0;
+				used += value_length;
+			}
+			return offset + used;
+		}
+	}
+	return 0;
+}
+
+// Reads an attribute of an OPEN op, returns where the next one is.
+const unsigned char* ctml_oplog_attribute(const unsigned char* attributes, CTML_OpAttribute* attribute) {
+	const unsigned char* p = attributes;
+	attribute->nameLength = p[0];
+	attribute->name = (const char*)p + 1;
+	p += 1 + p[0];
+	attribute->escape = p[0];
+	attribute->valueLength = ctml_oplog_get32(p + 1);
+	attribute->value = (const char*)p + 5;
+	return p + 5 + attribute->valueLength;
+}
+
+static int ctml_oplog_space(char c) {
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// Writes text escaped, with runs of whitespace replaced by a space.
+static void ctml_oplog_minify(CTML_Context* ctx, const char* text, size_t length) {
+	size_t start = 0;
+	size_t i = 0;
+	while (i < length) {
+		if (!ctml_oplog_space(text[i])) {
+			i++;
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < length && ctml_oplog_space(text[end])) {
+			end++;
+		}
+		if (end - i > 1 || text[i] != ' ') {
+			ctml_escape_textn(ctx, text + start, i - start);
+			ctml_write(ctx, " ", 1);
+			start = end;
+		}
+		i = end;
+	}
+	ctml_escape_textn(ctx, text + start, length - start);
+}
+
+// Writes the HTML of a log to ctx, in the given style. In pretty
+// style, the indentation starts at the one of ctx.
+void ctml_oplog_replay(CTML_Context* ctx, const char* log, size_t length, int style) {
+	int pretty = style == CTML_OPLOG_PRETTY;
+	int depth = ctx->indent;
+	int in_line = 0; // Text or raw output was written since the last tag
+	CTML_Op op;
+	size_t offset = 0;
+	while (!ctx->failed && (offset = ctml_oplog_next(log, length, offset, &op)) != 0) {
+		switch (op.type) {
+			case CTML_OP_RAW:
+			case CTML_OP_TEXT:
+				if (pretty && !in_line) {
+					ctml_spaces(ctx, depth);
+				}
+				in_line = 1;
+				if (op.type == CTML_OP_RAW) {
+					ctml_write(ctx, op.data, op.length);
+				} else if (style == CTML_OPLOG_MINIFIED) {
+					ctml_oplog_minify(ctx, op.data, op.length);
+				} else {
+					ctml_escape_textn(ctx, op.data, op.length);
+				}
+				break;
+			case CTML_OP_OPEN: {
+				if (pretty) {
+					if (in_line) ctml_write(ctx, "\n", 1);
+					ctml_spaces(ctx, depth);
+				}
+				in_line = 0;
+				ctml_write(ctx, "<", 1);
+				ctml_write(ctx, op.name, op.nameLength);
+				const unsigned char* p = op.attributes;
+				for (int i = 0; i < op.attributeCount; i++) {
+					CTML_OpAttribute attribute;
+					p = ctml_oplog_attribute(p, &attribute);
+					ctml_write(ctx, " ", 1);
+					ctml_write(ctx, attribute.name, attribute.nameLength);
+					ctml_write(ctx, "=\"", 2);
+					if (attribute.escape) {
+						ctml_escape_textn(ctx, attribute.value, attribute.valueLength);
+					} else {
+						ctml_write(ctx, attribute.value, attribute.valueLength);
+					}
+					ctml_write(ctx, "\"", 1);
+				}
+				if (op.selfClose) {
+					ctml_write(ctx, "/>", 2);
+				} else {
+					ctml_write(ctx, ">", 1);
+					depth++;
+				}
+				if (pretty) ctml_write(ctx, "\n", 1);
+				break;
+			}
+			case CTML_OP_CLOSE:
+				depth--;
+				if (pretty) {
+					if (in_line) ctml_write(ctx, "\n", 1);
+					ctml_spaces(ctx, depth);
+				}
+				in_line = 0;
+				ctml_write(ctx, "</", 2);
+				ctml_write(ctx, op.name, op.nameLength);
+				ctml_write(ctx, ">", 1);
+				if (pretty) ctml_write(ctx, "\n", 1);
+				break;
+		}
+	}
+	if (pretty && in_line) {
+		ctml_write(ctx, "\n", 1);
+	}
+}
+
+void ctml_oplog_free(CTML_OpLog* log) {
+	ctml_arena_free(&log->arena);
+	*log = (CTML_OpLog){0};
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_OPLOG_H
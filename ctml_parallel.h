@@ -0,0 +1,438 @@
+/*
+ * ctml_parallel.h
+ * * Parallel rendering for ctml: the tasks of a ctml_parallel block are
+ * * rendered by a work-stealing thread pool, each in its own arena, and
+ * * their HTML is spliced in document order. Needs libc, C11 atomics and
+ * * pthreads. Include it after ctml.h (the implementation is enabled by
+ * * CTML_IMPLEMENTATION as well).
+ * * Example:
+ * void render_panel(CTML_Context* ctx, void* arg) { ... }
+ *
+ * ctml_parallel {
+ *     for (int i = 0; i < panel_count; i++) {
+ *         ctml_task(render_panel, &panels[i]);
+ *     }
+ * }
+ */
+
+#ifndef CTML_PARALLEL_H
+#define CTML_PARALLEL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Number of threads of ctml_default_pool, 0 means one per core.
+#ifndef CTML_PARALLEL_THREADS
+	#define CTML_PARALLEL_THREADS 0
+#endif
+
+typedef void (*ctmlTaskFunction) (CTML_Context* ctx, void* arg);
+
+struct CTML_Parallel;
+
+// A task, or the HTML written between two tasks (function is then NULL).
+typedef struct CTML_ParallelNode {
+	struct CTML_ParallelNode* next;
+	struct CTML_Parallel* group;
+	ctmlTaskFunction function;
+	void* arg;
+	CTML_Context* context; // Renders in arena
+	CTML_Arena arena;
+	atomic_int done;
+} CTML_ParallelNode;
+
+// Tasks waiting to be run. The owner pushes and pops at the bottom,
+// other threads steal the oldest tasks from the top.
+typedef struct {
+	pthread_mutex_t lock;
+	CTML_ParallelNode** items;
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+} CTML_Deque;
+
+/*
+ * CTML_Pool structure
+ * Every worker has its own deque, the last deque receives the tasks
+ * of the other threads. Idle workers steal from the others.
+*/
+typedef struct {
+	int threads;
+	pthread_t* workers;
+	CTML_Deque* deques;
+	atomic_size_t queued;
+	atomic_int stop;
+	atomic_int waiters; // Threads waiting for a task in ctml_parallel_wait
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t progress; // A task was done or queued, for the waiters
+} CTML_Pool;
+
+// State of a ctml_parallel block.
+typedef struct CTML_Parallel {
+	CTML_Pool* pool;
+	CTML_Context* parent;
+	CTML_ParallelNode* first;
+	CTML_ParallelNode* last;
+	int state;
+} CTML_Parallel;
+
+int ctml_pool_init(CTML_Pool* pool, int threads);
+void ctml_pool_destroy(CTML_Pool* pool);
+CTML_Pool* ctml_default_pool(void);
+int ctml_parallel_begin(CTML_Parallel* parallel);
+void ctml_parallel_end(CTML_Parallel* parallel);
+CTML_Context* ctml_parallel_task(CTML_Parallel* parallel, CTML_Context* ctx, ctmlTaskFunction function, void* arg);
+
+// Runs the ctml_task of the block on pool. Once the block is done,
+// the HTML of the tasks (and what was written between them) is
+// spliced in order, each task as soon as it and the previous ones
+// are finished. NOTE: like h(), the block must not be left with
+// break/return/goto.
+#define ctml_parallel_in(p)                                                                      \
+	for (CTML_Parallel _parallel = {.pool = (p), .parent = CTML_CTX_NAME};                   \
+	     ctml_parallel_begin(&_parallel); ctml_parallel_end(&_parallel))                     \
+	for (CTML_Context* CTML_CTX_NAME = _parallel.parent; CTML_CTX_NAME; CTML_CTX_NAME = NULL)
+
+#define ctml_parallel ctml_parallel_in(ctml_default_pool())
+
+// Renders function(ctx, arg) on the pool, in a context indented like
+// the current one. Must be used directly inside of a ctml_parallel block
+// (not in a function called from it), arg must stay valid until the end
+// of the block. When the context has a tag hook or a recorder, which must
+// see the tags in document order, tasks are rendered right away instead.
+#define ctml_task(f, arg) CTML_CTX_NAME = ctml_parallel_task(&_parallel, CTML_CTX_NAME, f, arg);
+
+
+#ifdef CTML_IMPLEMENTATION
+
+// Pool and deque of the current thread, if it is a worker.
+static _Thread_local CTML_Pool* ctml_pool_self;
+static _Thread_local int ctml_pool_self_index;
+
+static int ctml_deque_push(CTML_Deque* deque, CTML_ParallelNode* node) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom == deque->capacity) {
+		if (deque->top != 0) {
+			// Reuses the room of the stolen tasks.
+			memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top) * sizeof(node));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		} else {
+			size_t capacity = deque->capacity ? deque->capacity * 2 : 32;
+			CTML_ParallelNode** items = CTML_REALLOC(deque->items, capacity * sizeof(node));
+			if (items == NULL) {
+				pthread_mutex_unlock(&deque->lock);
+				return 0;
+			}
+			deque->items = items;
+			deque->capacity = capacity;
+		}
+	}
+	deque->items[deque->bottom++] = node;
+	pthread_mutex_unlock(&deque->lock);
+	return 1;
+}
+
+static CTML_ParallelNode* ctml_deque_take(CTML_Deque* deque, int steal) {
+	CTML_ParallelNode* node = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top != deque->bottom) {
+		node = steal ? deque->items[deque->top++] : deque->items[--deque->bottom];
+		if (deque->top == deque->bottom) {
+			deque->top = deque->bottom = 0;
+		}
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return node;
+}
+
+// Deque the current thread pushes to and pops from.
+static int ctml_pool_own_deque(CTML_Pool* pool) {
+	return ctml_pool_self == pool ? ctml_pool_self_index : pool->threads;
+}
+
+// Returns a task to run: the newest of the own deque, or the
+// oldest of another one. NULL if there is none.
+static CTML_ParallelNode* ctml_pool_find(CTML_Pool* pool) {
+	if (atomic_load(&pool->queued) == 0) return NULL;
+	int own = ctml_pool_own_deque(pool);
+	CTML_ParallelNode* node = ctml_deque_take(&pool->deques[own], 0);
+	for (int i = 1; node == NULL && i <= pool->threads; i++) {
+		node = ctml_deque_take(&pool->deques[(own + i) % (pool->threads + 1)], 1);
+	}
+	if (node != NULL) {
+		atomic_fetch_sub(&pool->queued, 1);
+	}
+	return node;
+}
+
+static void ctml_parallel_run(CTML_ParallelNode* node) {
+	node->function(node->context, node->arg);
+	ctml_flush_buffer(node->context);
+	// The node can be freed as soon as it is done.
+	CTML_Pool* pool = node->group->pool;
+	atomic_store(&node->done, 1);
+	// A waiter counts itself before checking done (see ctml_parallel_wait),
+	// so it is either seen here or sees done.
+	if (atomic_load(&pool->waiters) != 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->progress);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void ctml_pool_submit(CTML_Pool* pool, CTML_ParallelNode* node) {
+	if (!ctml_deque_push(&pool->deques[ctml_pool_own_deque(pool)], node)) {
+		ctml_parallel_run(node);
+		return;
+	}
+	atomic_fetch_add(&pool->queued, 1);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->wake);
+	// Waiters help with the tasks as well.
+	if (atomic_load(&pool->waiters) != 0) {
+		pthread_cond_broadcast(&pool->progress);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void* ctml_pool_worker(void* arg) {
+	CTML_Pool* pool = arg;
+	ctml_pool_self = pool;
+	// The index is given by ctml_pool_init through the deque count.
+	pthread_mutex_lock(&pool->lock);
+	ctml_pool_self_index = pool->threads++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (!atomic_load(&pool->stop)) {
+		CTML_ParallelNode* node = ctml_pool_find(pool);
+		if (node != NULL) {
+			ctml_parallel_run(node);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+// Starts threads workers (one per core if threads is 0).
+// Returns 0 if no thread could be started: tasks are then
+// rendered by the threads waiting for them.
+int ctml_pool_init(CTML_Pool* pool, int threads) {
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0) threads = 1;
+	}
+	*pool = (CTML_Pool){0};
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->progress, NULL);
+	pool->workers = CTML_MALLOC(threads * sizeof(pthread_t));
+	pool->deques = CTML_MALLOC((threads + 1) * sizeof(CTML_Deque));
+	if (pool->workers == NULL || pool->deques == NULL) {
+		threads = 0;
+	}
+	for (int i = 0; i <= threads && pool->deques != NULL; i++) {
+		pool->deques[i] = (CTML_Deque){0};
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+	if (pool->deques == NULL) {
+		// At least the deque of the other threads is needed.
+		pool->deques = CTML_MALLOC(sizeof(CTML_Deque));
+		if (pool->deques == NULL) return 0;
+		pool->deques[0] = (CTML_Deque){0};
+		pthread_mutex_init(&pool->deques[0].lock, NULL);
+	}
+
+	// Workers take their index when they start, pool->threads
+	// is the number of started workers until they all are.
+	int started = 0;
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&pool->workers[started], NULL, ctml_pool_worker, pool) == 0) {
+			started++;
+		}
+	}
+	pthread_mutex_lock(&pool->lock);
+	while (pool->threads != started) {
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	// The deque of the other threads is the one after the last
+	// started worker, it is initialized like all of them.
+	return started != 0;
+}
+
+// Stops the workers, the pool must not be used anymore.
+void ctml_pool_destroy(CTML_Pool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	atomic_store(&pool->stop, 1);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->threads; i++) {
+		pthread_join(pool->workers[i], NULL);
+	}
+	for (int i = 0; i <= pool->threads; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		CTML_FREE(pool->deques[i].items);
+	}
+	CTML_FREE(pool->deques);
+	CTML_FREE(pool->workers);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->progress);
+}
+
+static CTML_Pool ctml_default_pool_storage;
+static pthread_once_t ctml_default_pool_once = PTHREAD_ONCE_INIT;
+
+static void ctml_default_pool_init(void) {
+	ctml_pool_init(&ctml_default_pool_storage, CTML_PARALLEL_THREADS);
+}
+
+// Pool of ctml_parallel, started on first use.
+CTML_Pool* ctml_default_pool(void) {
+	pthread_once(&ctml_default_pool_once, ctml_default_pool_init);
+	return &ctml_default_pool_storage;
+}
+
+int ctml_parallel_begin(CTML_Parallel* parallel) {
+	if (parallel->state != 0) {
+		return 0;
+	}
+	parallel->state = 1;
+	return 1;
+}
+
+// Creates a node rendering in its own arena, indented like ctx.
+static CTML_ParallelNode* ctml_parallel_node(CTML_Parallel* parallel, CTML_Context* ctx, ctmlTaskFunction function, void* arg) {
+	CTML_ParallelNode* node = CTML_MALLOC(sizeof(CTML_ParallelNode));
+	if (node == NULL) return NULL;
+	*node = (CTML_ParallelNode){.group = parallel, .function = function, .arg = arg};
+	node->context = CTML_MALLOC(sizeof(CTML_Context));
+	if (node->context == NULL) {
+		CTML_FREE(node);
+		return NULL;
+	}
+	*node->context = (CTML_Context){.arena = &node->arena, .indent = ctx->indent};
+	#ifdef CTML_STATS
+		// Added to the ones of the parent once spliced.
+		node->context->stats.depth = ctx->stats.depth;
+		node->context->stats.maxDepth = ctx->stats.depth;
+	#endif
+	// What is written between tasks is usually small.
+	if (function == NULL) {
+		ctml_arena_reserve(&node->arena, 256);
+	}
+	ctml_begin(node->context);
+	atomic_init(&node->done, function == NULL);
+	if (parallel->last != NULL) {
+		parallel->last->next = node;
+	} else {
+		parallel->first = node;
+	}
+	parallel->last = node;
+	return node;
+}
+
+// Submits a task, and returns the context where what follows it
+// is written until the next one.
+CTML_Context* ctml_parallel_task(CTML_Parallel* parallel, CTML_Context* ctx, ctmlTaskFunction function, void* arg) {
+	if (parallel->parent->failed) {
+		return ctx;
+	}
+	if (parallel->parent->tagHook || parallel->parent->recorder) {
+		function(ctx, arg);
+		return ctx;
+	}
+	if (ctx != parallel->parent) {
+		ctml_flush_buffer(ctx);
+	}
+	CTML_ParallelNode* task = ctml_parallel_node(parallel, ctx, function, arg);
+	if (task == NULL) {
+		// Rendered right away instead.
+		function(ctx, arg);
+		return ctx;
+	}
+	ctml_pool_submit(parallel->pool, task);
+	CTML_ParallelNode* next = ctml_parallel_node(parallel, ctx, NULL, NULL);
+	if (next == NULL) {
+		// What follows is written after the task when it is done.
+		return ctx;
+	}
+	return next->context;
+}
+
+// Waits for node, running tasks in the meantime.
+static void ctml_parallel_wait(CTML_Parallel* parallel, CTML_ParallelNode* node) {
+	int flushed = 0;
+	while (!atomic_load(&node->done)) {
+		CTML_ParallelNode* other = ctml_pool_find(parallel->pool);
+		if (other != NULL) {
+			ctml_parallel_run(other);
+			continue;
+		}
+		if (!flushed) {
+			// What is ready is sent before waiting.
+			ctml_flush(parallel->parent);
+			flushed = 1;
+			continue;
+		}
+		// Woken up when a task is done, or queued (to help with it).
+		CTML_Pool* pool = parallel->pool;
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->waiters, 1);
+		while (!atomic_load(&node->done) && atomic_load(&pool->queued) == 0) {
+			pthread_cond_wait(&pool->progress, &pool->lock);
+		}
+		atomic_fetch_sub(&pool->waiters, 1);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void ctml_parallel_end(CTML_Parallel* parallel) {
+	CTML_Context* parent = parallel->parent;
+	parallel->state = 2;
+	if (parallel->last != NULL) {
+		// Tags can be opened before a task and closed after it.
+		parent->indent = parallel->last->context->indent;
+	}
+	CTML_ParallelNode* node = parallel->first;
+	while (node != NULL) {
+		CTML_ParallelNode* next = node->next;
+		if (node->function != NULL) {
+			ctml_parallel_wait(parallel, node);
+		} else {
+			ctml_flush_buffer(node->context);
+		}
+		ctml_write(parent, node->arena.data, node->arena.length);
+		#ifdef CTML_STATS
+			// Only what was rendered: the bytes, flushes and sink calls
+			// are the ones of the parent.
+			CTML_Stats* stats = &node->context->stats;
+			parent->stats.tags += stats->tags;
+			parent->stats.bytesEscaped += stats->bytesEscaped;
+			parent->stats.bytesPassedThrough += stats->bytesPassedThrough;
+			if (stats->maxDepth > parent->stats.maxDepth) {
+				parent->stats.maxDepth = stats->maxDepth;
+			}
+			if (next == NULL) {
+				parent->stats.depth = stats->depth;
+			}
+		#endif
+		CTML_FREE(node->context);
+		ctml_arena_free(&node->arena);
+		CTML_FREE(node);
+		node = next;
+	}
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_PARALLEL_H
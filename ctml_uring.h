@@ -0,0 +1,427 @@
+/*
+ * ctml_uring.h
+ * * io_uring sink for ctml (Linux 5.6 or later, raw syscalls, no liburing):
+ * * when the buffer is full it is submitted to the kernel and the rendering
+ * * goes on right away in a second buffer, so templates run while the
+ * * previous one is being written. Buffers come from a pool registered with
+ * * the ring and shared by the streams (one per response) of a thread.
+ * * Needs libc. Include it after ctml.h (the implementation is enabled by
+ * * CTML_IMPLEMENTATION as well).
+ * * Example:
+ * static _Thread_local CTML_Uring ring; // ctml_uring_init(&ring, 64, 16 * 1024)
+ * CTML_UringStream stream = {.ring = &ring, .fd = client_fd};
+ * ctml_uring(&stream, .chunked = 1) { page(ctx); }
+ * ctml_uring_wait(&stream); // Or later, from the event loop (ctml_uring_reap)
+ */
+
+#ifndef CTML_URING_H
+#define CTML_URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * CTML_Uring structure
+ * A ring and its pool of buffers, used by one thread. Every stream being
+ * rendered holds up to two buffers (one being filled, one being written).
+*/
+typedef struct {
+	int fd;
+	// Submission queue
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqArray;
+	unsigned sqMask;
+	unsigned sqEntries;
+	struct io_uring_sqe* sqes;
+	// Completion queue
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+	// When set, writes are only queued, and sent to the kernel all at
+	// once by ctml_uring_submit (or when a stream has to wait).
+	int batch;
+	unsigned queued; // Entries not submitted yet
+	unsigned inFlight; // Entries not completed yet
+	// Buffers, pre-faulted and registered when possible
+	// (written with IORING_OP_WRITE_FIXED then).
+	char* memory;
+	size_t bufferSize;
+	unsigned bufferCount;
+	int registered;
+	unsigned* freeBuffers; // Indexes of the free buffers
+	unsigned freeCount;
+} CTML_Uring;
+
+/*
+ * CTML_UringStream structure
+ * The output of one response: ring and fd are set by the caller, the rest
+ * is zeroed. Only one of its writes is in flight at a time, so the bytes
+ * reach fd in order (short writes are resumed). It must stay alive until
+ * its last write completed.
+*/
+typedef struct CTML_UringStream {
+	CTML_Uring* ring;
+	int fd;
+	// Called once the stream ended and its last write completed (like to
+	// close fd), from ctml_uring_end or when completions are reaped.
+	void (*done) (struct CTML_UringStream* stream);
+	void* userData;
+	int error; // errno of the first failed write, 0 if none
+	CTML_Context* ctx;
+	unsigned buffer; // Index + 1 of the buffer of ctx, 0 if none
+	unsigned sending; // Index + 1 of the buffer being written, 0 if none
+	size_t sendOffset; // What is left to write in it
+	size_t sendEnd;
+	int ended;
+} CTML_UringStream;
+
+int ctml_uring_init(CTML_Uring* ring, unsigned bufferCount, size_t bufferSize);
+void ctml_uring_free(CTML_Uring* ring);
+int ctml_uring_submit(CTML_Uring* ring);
+int ctml_uring_reap(CTML_Uring* ring, int wait);
+int ctml_uring_write(const char* data, size_t length, void* userData);
+void ctml_uring_begin(CTML_UringStream* stream, CTML_Context* ctx);
+void ctml_uring_end(CTML_UringStream* stream, CTML_Context* ctx);
+int ctml_uring_wait(CTML_UringStream* stream);
+
+// Like ctml(), with the same arguments (but the sink): the HTML is written
+// to stream->fd through its ring. The block returns once the last buffer
+// was submitted, not written (see ctml_uring_wait and done).
+#define ctml_uring(stream, ...)                                                                     \
+	CTML_Context ctml_context = (CTML_Context) {.write = ctml_uring_write, .userData = (stream), __VA_ARGS__}; \
+	CTML_Context* CTML_CTX_NAME = &ctml_context;                                                 \
+	ctml_uring_begin(stream, CTML_CTX_NAME);                                                     \
+	for (int _once = 0; _once < 1; _once = 1, ctml_uring_end(stream, CTML_CTX_NAME))
+
+
+#ifdef CTML_IMPLEMENTATION
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int ctml_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+// Set in the user_data of polls (the rest is the stream).
+#define CTML_URING_POLL 1
+
+static char* ctml_uring_buffer(CTML_Uring* ring, unsigned index) {
+	return ring->memory + (size_t)(index - 1) * ring->bufferSize;
+}
+
+// Returns 0 or -errno. The ring can be freed even if this failed.
+int ctml_uring_init(CTML_Uring* ring, unsigned bufferCount, size_t bufferSize) {
+	*ring = (CTML_Uring){.fd = -1};
+	if (bufferCount < 2 || bufferSize < 2 || bufferSize > 0xffffffffu) return -EINVAL;
+	// Every write uses a buffer and may follow a poll, so at most twice as
+	// many entries are in flight: the completion queue (twice as big as the
+	// submission queue) cannot overflow. The submission queue is submitted
+	// when full (see ctml_uring_room).
+	struct io_uring_params params = {0};
+	ring->fd = (int)syscall(__NR_io_uring_setup, bufferCount, &params);
+	if (ring->fd < 0) return -errno;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		int error = -errno;
+		ctml_uring_free(ring);
+		return error;
+	}
+	char* sq = ring->sqRing;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	char* cq = ring->cqRing;
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	ring->bufferSize = bufferSize;
+	ring->bufferCount = bufferCount;
+	ring->memory = mmap(NULL, bufferCount * bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	ring->freeBuffers = CTML_MALLOC(bufferCount * sizeof(unsigned));
+	if (ring->memory == MAP_FAILED || ring->freeBuffers == NULL) {
+		int error = ring->memory == MAP_FAILED ? -errno : -ENOMEM;
+		ctml_uring_free(ring);
+		return error;
+	}
+	for (unsigned i = 0; i < bufferCount; i++) {
+		ring->freeBuffers[i] = bufferCount - i;
+	}
+	ring->freeCount = bufferCount;
+	// Without registration (like over RLIMIT_MEMLOCK), plain writes are used.
+	struct iovec* iov = CTML_MALLOC(bufferCount * sizeof(struct iovec));
+	if (iov != NULL) {
+		for (unsigned i = 0; i < bufferCount; i++) {
+			iov[i] = (struct iovec){ctml_uring_buffer(ring, i + 1), bufferSize};
+		}
+		ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, bufferCount) == 0;
+		CTML_FREE(iov);
+	}
+	return 0;
+}
+
+// Writes must be completed first (see ctml_uring_reap).
+void ctml_uring_free(CTML_Uring* ring) {
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED) munmap(ring->cqRing, ring->cqRingSize);
+	if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) munmap(ring->sqRing, ring->sqRingSize);
+	if (ring->memory != NULL && ring->memory != MAP_FAILED) munmap(ring->memory, ring->bufferCount * ring->bufferSize);
+	if (ring->fd >= 0) close(ring->fd);
+	CTML_FREE(ring->freeBuffers);
+	*ring = (CTML_Uring){.fd = -1};
+}
+
+// Sends the queued writes to the kernel. Returns 0 or -errno.
+int ctml_uring_submit(CTML_Uring* ring) {
+	while (ring->queued != 0) {
+		int submitted = ctml_uring_enter(ring->fd, ring->queued, 0, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		ring->queued -= submitted;
+	}
+	return 0;
+}
+
+// Makes room for count entries in the submission queue.
+// Returns 0 or -errno.
+static int ctml_uring_room(CTML_Uring* ring, unsigned count) {
+	unsigned used = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	return ring->sqEntries - used >= count ? 0 : ctml_uring_submit(ring);
+}
+
+// Zeroed entry at tail (published by moving the tail).
+static struct io_uring_sqe* ctml_uring_entry(CTML_Uring* ring, unsigned tail, uint64_t userData) {
+	unsigned slot = tail & ring->sqMask;
+	struct io_uring_sqe* sqe = &ring->sqes[slot];
+	*sqe = (struct io_uring_sqe){0};
+	sqe->user_data = userData;
+	ring->sqArray[slot] = slot;
+	return sqe;
+}
+
+static void ctml_uring_release(CTML_Uring* ring, unsigned index) {
+	ring->freeBuffers[ring->freeCount++] = index;
+}
+
+// The sending buffer is done with (written or failed).
+static void ctml_uring_sent(CTML_Uring* ring, CTML_UringStream* stream) {
+	ctml_uring_release(ring, stream->sending);
+	stream->sending = 0;
+	if (stream->ended && stream->done) {
+		stream->done(stream);
+	}
+}
+
+// Queues the write of what is left of the sending buffer. With poll, the
+// fd was full (EAGAIN): the write is linked to a poll for POLLOUT, so it
+// only starts once the fd can take more.
+static void ctml_uring_send(CTML_UringStream* stream, int poll) {
+	CTML_Uring* ring = stream->ring;
+	unsigned count = poll ? 2 : 1;
+	int error = ctml_uring_room(ring, count);
+	if (error != 0) {
+		if (stream->error == 0) stream->error = -error;
+		ctml_uring_sent(ring, stream);
+		return;
+	}
+	unsigned tail = *ring->sqTail;
+	struct io_uring_sqe* sqe;
+	if (poll) {
+		sqe = ctml_uring_entry(ring, tail++, (uint64_t)(uintptr_t)stream | CTML_URING_POLL);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = stream->fd;
+		sqe->poll_events = POLLOUT;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+	sqe = ctml_uring_entry(ring, tail++, (uint64_t)(uintptr_t)stream);
+	sqe->opcode = ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = stream->fd;
+	sqe->off = (uint64_t)-1; // Current position, for files
+	sqe->addr = (uint64_t)(uintptr_t)(ctml_uring_buffer(ring, stream->sending) + stream->sendOffset);
+	sqe->len = (unsigned)(stream->sendEnd - stream->sendOffset);
+	sqe->buf_index = (uint16_t)(stream->sending - 1);
+	__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+	ring->queued += count;
+	ring->inFlight += count;
+	if (!ring->batch && ctml_uring_submit(ring) != 0 && stream->error == 0) {
+		stream->error = errno;
+	}
+}
+
+static void ctml_uring_complete(CTML_Uring* ring, uint64_t userData, int result) {
+	ring->inFlight--;
+	// Nothing to do for polls: if one failed, its write is canceled. The
+	// stream is not used, as its write may have been reaped (and the
+	// stream be done) first.
+	if (userData & CTML_URING_POLL) return;
+	CTML_UringStream* stream = (CTML_UringStream*)(uintptr_t)userData;
+	if (result == -EINTR || result == -EAGAIN) {
+		ctml_uring_send(stream, result == -EAGAIN);
+		return;
+	}
+	if (result < 0) {
+		if (stream->error == 0) stream->error = -result;
+	} else {
+		stream->sendOffset += result;
+		if (stream->sendOffset < stream->sendEnd && result > 0) {
+			// Short write
+			ctml_uring_send(stream, 0);
+			return;
+		}
+		if (stream->sendOffset < stream->sendEnd && stream->error == 0) {
+			stream->error = EIO;
+		}
+	}
+	ctml_uring_sent(ring, stream);
+}
+
+// Handles the completed writes, after waiting for one if wait is set and
+// there is none yet. Returns how many were handled, or -errno.
+int ctml_uring_reap(CTML_Uring* ring, int wait) {
+	unsigned head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) && (ring->queued != 0 || (wait && ring->inFlight != 0))) {
+		int waiting = wait && ring->inFlight != 0;
+		int submitted = ctml_uring_enter(ring->fd, ring->queued, waiting, waiting ? IORING_ENTER_GETEVENTS : 0);
+		if (submitted < 0) {
+			if (errno != EINTR) return -errno;
+		} else {
+			ring->queued -= submitted;
+		}
+	}
+	int count = 0;
+	while ((head = *ring->cqHead) != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+		__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+		ctml_uring_complete(ring, cqe.user_data, cqe.res);
+		count++;
+	}
+	return count;
+}
+
+// Waits until the stream has no write in flight. Returns 0, or -1 if it failed.
+static int ctml_uring_wait_sent(CTML_UringStream* stream) {
+	while (stream->sending != 0) {
+		int result = ctml_uring_reap(stream->ring, 1);
+		if (result < 0) {
+			stream->error = -result;
+			return -1;
+		}
+	}
+	return stream->error != 0 ? -1 : 0;
+}
+
+// Returns the index + 1 of a free buffer, waiting for one if needed.
+static unsigned ctml_uring_take(CTML_UringStream* stream) {
+	CTML_Uring* ring = stream->ring;
+	while (ring->freeCount == 0) {
+		if (ring->inFlight == 0) {
+			// Every buffer is held by a stream being rendered.
+			if (stream->error == 0) stream->error = ENOBUFS;
+			return 0;
+		}
+		int result = ctml_uring_reap(ring, 1);
+		if (result < 0) {
+			if (stream->error == 0) stream->error = -result;
+			return 0;
+		}
+	}
+	return ring->freeBuffers[--ring->freeCount];
+}
+
+// The sink of ctml_uring.
+int ctml_uring_write(const char* data, size_t length, void* userData) {
+	CTML_UringStream* stream = userData;
+	CTML_Uring* ring = stream->ring;
+	CTML_Context* ctx = stream->ctx;
+	// One write at a time keeps the bytes in order.
+	if (ctml_uring_wait_sent(stream) != 0) return -1;
+	char* current = stream->buffer ? ctml_uring_buffer(ring, stream->buffer) : NULL;
+	if (current != NULL && data >= current && data + length <= current + ring->bufferSize) {
+		// The buffer of the context is written as it is, and the
+		// rendering goes on in another one.
+		stream->sending = stream->buffer;
+		stream->sendOffset = data - current;
+		stream->sendEnd = stream->sendOffset + length;
+		ctml_uring_send(stream, 0);
+		stream->buffer = ctml_uring_take(stream);
+		if (stream->buffer == 0) return -1;
+		char* next = ctml_uring_buffer(ring, stream->buffer);
+		ctx->buffer = next + (ctx->buffer - current); // Keeps the room of .chunked
+		ctx->outputBuffer = next;
+		return stream->error != 0 ? -1 : 0;
+	}
+	// Anything else (codec output, chunk ends, big writes) may not
+	// outlive this call, so it is copied to a buffer.
+	while (length > 0) {
+		unsigned index = ctml_uring_take(stream);
+		if (index == 0) return -1;
+		size_t n = length < ring->bufferSize ? length : ring->bufferSize;
+		ctml_memcpy(ctml_uring_buffer(ring, index), data, n);
+		stream->sending = index;
+		stream->sendOffset = 0;
+		stream->sendEnd = n;
+		ctml_uring_send(stream, 0);
+		data += n;
+		length -= n;
+		if (length > 0 && ctml_uring_wait_sent(stream) != 0) return -1;
+	}
+	return stream->error != 0 ? -1 : 0;
+}
+
+void ctml_uring_begin(CTML_UringStream* stream, CTML_Context* ctx) {
+	stream->ctx = ctx;
+	stream->error = 0;
+	stream->ended = 0;
+	stream->buffer = ctml_uring_take(stream);
+	if (stream->buffer != 0) {
+		ctx->outputBuffer = ctml_uring_buffer(stream->ring, stream->buffer);
+		ctx->outputBufferSize = stream->ring->bufferSize;
+	}
+	ctml_begin(ctx);
+}
+
+void ctml_uring_end(CTML_UringStream* stream, CTML_Context* ctx) {
+	ctml_end(ctx);
+	ctx->outputBuffer = NULL;
+	if (stream->buffer != 0) {
+		ctml_uring_release(stream->ring, stream->buffer);
+		stream->buffer = 0;
+	}
+	stream->ended = 1;
+	if (stream->sending == 0 && stream->done) {
+		stream->done(stream);
+	}
+}
+
+// Waits until everything was written. Returns 0, or the errno of the
+// write that failed.
+int ctml_uring_wait(CTML_UringStream* stream) {
+	ctml_uring_wait_sent(stream);
+	return stream->error;
+}
+
+#endif // CTML_IMPLEMENTATION
+
+#endif // CTML_URING_H
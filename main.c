@@ -1,5 +1,4 @@
 #include <unistd.h>
-#include <string.h>
 #define CTML_NOLIBC
 #define CTML_PRETTY
 #define CTML_CUSTOM_ATTRIBUTES X(toto);XL(da, data-attr);
@@ -7,9 +6,8 @@
 #include "ctml.h"
 #include "ctml_short.h"
 
-void sink(char* src, void*_) {
-	write(1, src, strlen(src));
-	
+int sink(const char* src, size_t length, void*_) {
+	return write(1, src, length) == (ssize_t)length ? 0 : -1;
 }
 
 void cbutton(CTML_Context* ctx) {
@@ -21,7 +19,7 @@ void cbutton(CTML_Context* ctx) {
 void ui() {
 	{
 		ctml(
-			.sink=sink
+			.write=sink
 		) {
 			ctml_raw("<!DOCTYPE html>");
 			html(.lang="en") {
@@ -40,7 +38,7 @@ void ui() {
 	{
 
 		ctml(
-			.sink=sink
+			.write=sink
 		){
 			div() {
 				ctml_raw("another one");
@@ -1,31 +1,76 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/socket.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 // --- CTML Configuration ---
-#define CTML_PRETTY 
+#define CTML_PRETTY
 #define CTML_CUSTOM_ATTRIBUTES X(onclick);
 #define CTML_IMPLEMENTATION
 #include "ctml.h"
 #include "ctml_short.h"
+#include "ctml_cache.h"
 
-// --- The Sink Function ---
-// Receives the HTML chunk and the client socket FD via userData
-void socket_sink(char* data, void* userData) {
-    int client_fd = *(int*)userData;
-    send(client_fd, data, strlen(data), MSG_NOSIGNAL);
-}
+// --- Server Configuration ---
+#define PORT 8080
+#define MAX_EVENTS 256
+#define REQUEST_MAX 8192         // Bigger requests are rejected
+#define KEEPALIVE_TIMEOUT 5      // Seconds before an idle connection is closed
+#define SHUTDOWN_TIMEOUT 5       // Seconds given to pending responses on shutdown
+
+static atomic_int visitor_count;
+static atomic_int stopping;
+static int shutdown_fd; // eventfd signaled on SIGINT/SIGTERM, watched by every worker
+
+typedef struct Connection {
+    int fd;
+    char request[REQUEST_MAX];
+    size_t requestLength;
+    // Part of the response the socket did not accept yet.
+    char* pending;
+    size_t pendingLength;
+    size_t pendingSent;
+    int closeAfterWrite;
+    time_t lastActive;
+    struct Connection* prev;
+    struct Connection* next;
+} Connection;
+
+// Every worker has its own listening socket (SO_REUSEPORT lets the kernel
+// spread the connections), its own epoll instance and its own ctml context
+// rendering into an arena, so workers never share anything but the
+// fragment cache.
+typedef struct {
+    pthread_t thread;
+    int id;
+    int listen_fd;
+    int epoll_fd;
+    CTML_Arena arena;
+    CTML_Context context;
+    Connection* connections;
+    unsigned long requests;
+} Worker;
 
 // --- HTML Page Generator ---
-void render_homepage(int client_fd, int visitor_count) {
-    // Pass the client_fd address as userData to the context
-    ctml(.sink = socket_sink, .userData = &client_fd) {
-        
-       ctml_raw("<!DOCTYPE html>");
-        html(.lang="en") {
+// Renders into ctx, which is reused for every request of a worker.
+void render_homepage(CTML_Context* ctx, int visitor_count) {
+    ctml_raw("<!DOCTYPE html>");
+    html(.lang="en") {
+        // The head never changes, it is only rendered once.
+        ctml_cached("head", 0) {
             head() {
                 title() {ctml_raw("CTML Server"); }
                 h(style) {
@@ -33,84 +78,418 @@ void render_homepage(int client_fd, int visitor_count) {
                    ctml_raw(".box { border: 2px solid #333; padding: 20px; display: inline-block; }");
                 }
             }
-            body() {
-                div(.class="box") {
-                    h1() {ctml_raw("Hello from C!"); }
-                    p() {ctml_raw("This HTML was generated directly by the CTML library."); }
-                    
-                    hr();
-                    
-                    div() {
-                        p() {ctml_rawf("You are visitor number: <strong>%d</strong>", visitor_count);}
-                        p() {ctml_text("You are visitor number: '' \" <> &  <strong>X</strong>");}
-                    }
-                    
-                    br();
-                    
-                    button(.onclick="location.reload()") {
-	                ctml_raw("Refresh Page");
-                    }
+        }
+        body() {
+            div(.class="box") {
+                // Only literals, so it is built at compile time.
+                ctml_static(
+                    ctml_st(h1, , ctml_sraw("Hello from C!"))
+                    ctml_st(p, , ctml_sraw("This HTML was generated directly by the CTML library."))
+                    ctml_sth(hr, )
+                )
+
+                div() {
+                    p() {ctml_rawf("You are visitor number: <strong>%d</strong>", visitor_count);}
+                    p() {ctml_text("You are visitor number: '' \" <> &  <strong>X</strong>");}
+                }
+
+                br();
+
+                button(.onclick="location.reload()") {
+                    ctml_raw("Refresh Page");
                 }
             }
         }
     }
 }
 
-// --- Main Server Loop ---
-int main() {
-    int server_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    int visitor_count = 0;
+void render_not_found(CTML_Context* ctx, const char* path, size_t path_length) {
+    ctml_raw("<!DOCTYPE html>");
+    html(.lang="en") {
+        body() {
+            h1() { ctml_raw("404 Not Found"); }
+            p() { ctml_textf("%.*s", (int)path_length, path); }
+        }
+    }
+}
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+// --- Connections ---
+static void close_connection(Worker* worker, Connection* conn) {
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->prev) conn->prev->next = conn->next;
+    else worker->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    free(conn->pending);
+    free(conn);
+}
+
+// Sends what is pending. Returns -1 if the connection has to be closed,
+// 1 if the socket is full (EPOLLOUT is then watched) and 0 when done.
+static int flush_pending(Worker* worker, Connection* conn) {
+    while (conn->pendingSent < conn->pendingLength) {
+        ssize_t sent = send(conn->fd, conn->pending + conn->pendingSent,
+                            conn->pendingLength - conn->pendingSent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct epoll_event event = {.events = EPOLLOUT | EPOLLRDHUP, .data.ptr = conn};
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+                return 1;
+            }
+            return -1;
+        }
+        conn->pendingSent += sent;
     }
+    free(conn->pending);
+    conn->pending = NULL;
+    conn->pendingLength = conn->pendingSent = 0;
+    if (conn->closeAfterWrite) return -1;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    return 0;
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(8080);
+// Sends the header and the body (the arena of the worker) with a single
+// writev. What the socket does not take is copied into the connection.
+static int send_response(Worker* worker, Connection* conn, const char* header, size_t header_length) {
+    struct iovec iov[2] = {
+        {(void*)header, header_length},
+        {worker->arena.data, worker->arena.length},
+    };
+    size_t total = header_length + worker->arena.length;
+    ssize_t sent;
+    do {
+        sent = writev(conn->fd, iov, 2);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        sent = 0;
+    }
+    if ((size_t)sent == total) {
+        return conn->closeAfterWrite ? -1 : 0;
+    }
+    // The arena is reused by the next request, so the rest is copied.
+    conn->pendingLength = total - sent;
+    conn->pendingSent = 0;
+    conn->pending = malloc(conn->pendingLength);
+    if (conn->pending == NULL) return -1;
+    if ((size_t)sent < header_length) {
+        memcpy(conn->pending, header + sent, header_length - sent);
+        memcpy(conn->pending + header_length - sent, worker->arena.data, worker->arena.length);
+    } else {
+        memcpy(conn->pending, worker->arena.data + (sent - header_length), conn->pendingLength);
+    }
+    return flush_pending(worker, conn);
+}
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-        perror("setsockopt failed");
-        exit(EXIT_FAILURE);
+// Case insensitive search of a header, returns its value or NULL.
+static const char* find_header(const char* headers, const char* end, const char* name, size_t* length) {
+    size_t name_length = strlen(name);
+    const char* line = headers;
+    while (line < end) {
+        const char* line_end = memmem(line, end - line, "\r\n", 2);
+        if (line_end == NULL) line_end = end;
+        if ((size_t)(line_end - line) > name_length && line[name_length] == ':' &&
+            strncasecmp(line, name, name_length) == 0) {
+            const char* value = line + name_length + 1;
+            while (value < line_end && *value == ' ') value++;
+            *length = line_end - value;
+            return value;
+        }
+        line = line_end + 2;
     }
+    return NULL;
+}
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+// Handles one complete request (request_length bytes, headers included).
+static int handle_request(Worker* worker, Connection* conn, size_t request_length) {
+    const char* request = conn->request;
+    const char* end = request + request_length;
+    const char* method_end = memchr(request, ' ', request_length);
+    const char* path = method_end ? method_end + 1 : end;
+    const char* path_end = memchr(path, ' ', end - path);
+    if (method_end == NULL || path_end == NULL) {
+        path = path_end = end;
+        conn->closeAfterWrite = 1;
     }
+    const char* headers = memchr(path_end, '\n', end - path_end);
+    headers = headers ? headers + 1 : end;
 
-    if (listen(server_fd, 3) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
+    // HTTP/1.1 keeps the connection alive unless asked otherwise,
+    // HTTP/1.0 only when asked.
+    size_t value_length;
+    const char* connection = find_header(headers, end, "Connection", &value_length);
+    int http10 = path_end + 9 <= end && memcmp(path_end + 1, "HTTP/1.0", 8) == 0;
+    if (connection && value_length == 5 && strncasecmp(connection, "close", 5) == 0) {
+        conn->closeAfterWrite = 1;
+    } else if (http10 && !(connection && value_length == 10 && strncasecmp(connection, "keep-alive", 10) == 0)) {
+        conn->closeAfterWrite = 1;
     }
+    // Request bodies are not read, the connection cannot be reused after one.
+    const char* body_length = find_header(headers, end, "Content-Length", &value_length);
+    if (body_length && !(value_length == 1 && *body_length == '0')) {
+        conn->closeAfterWrite = 1;
+    }
+    if (atomic_load(&stopping)) {
+        conn->closeAfterWrite = 1;
+    }
+
+    // The context and its arena are reused: once the arena is big enough,
+    // rendering does not allocate anymore.
+    CTML_Context* ctx = &worker->context;
+    int status = 200;
+    ctml_arena_reset(&worker->arena);
+    ctml_begin(ctx);
+    if (path_end - path == 1 && *path == '/' && method_end - request == 3 && memcmp(request, "GET", 3) == 0) {
+        render_homepage(ctx, atomic_fetch_add(&visitor_count, 1) + 1);
+    } else {
+        status = 404;
+        render_not_found(ctx, path, path_end - path);
+    }
+    ctml_end(ctx);
+    if (worker->arena.failed) return -1;
+    worker->requests++;
 
-    printf("Server listening on http://localhost:8080\n");
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+        status == 200 ? "200 OK" : "404 Not Found", worker->arena.length,
+        conn->closeAfterWrite ? "close" : "keep-alive");
+    return send_response(worker, conn, header, header_length);
+}
 
+// Answers every complete request received (pipelined requests are
+// answered in order), then reads what is available.
+static void handle_readable(Worker* worker, Connection* conn) {
     while (1) {
-        int client_fd;
-        if ((client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept failed");
+        char* request_end;
+        while (conn->pending == NULL &&
+               (request_end = memmem(conn->request, conn->requestLength, "\r\n\r\n", 4)) != NULL) {
+            size_t length = request_end + 4 - conn->request;
+            if (handle_request(worker, conn, length) < 0) {
+                close_connection(worker, conn);
+                return;
+            }
+            conn->requestLength -= length;
+            memmove(conn->request, conn->request + length, conn->requestLength);
+        }
+        if (conn->pending != NULL) {
+            // Stop reading until the response is sent.
+            return;
+        }
+        if (conn->requestLength == REQUEST_MAX) {
+            // Too big to be a request we can answer.
+            close_connection(worker, conn);
+            return;
+        }
+
+        ssize_t received = recv(conn->fd, conn->request + conn->requestLength,
+                                REQUEST_MAX - conn->requestLength, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (received <= 0) {
+            close_connection(worker, conn);
+            return;
+        }
+        conn->requestLength += received;
+        conn->lastActive = time(NULL);
+    }
+}
+
+static void accept_connections(Worker* worker) {
+    while (1) {
+        int fd = accept4(worker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return; // EAGAIN, or out of fds
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+        Connection* conn = calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            close(fd);
             continue;
         }
+        conn->fd = fd;
+        conn->lastActive = time(NULL);
+        conn->next = worker->connections;
+        if (conn->next) conn->next->prev = conn;
+        worker->connections = conn;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close_connection(worker, conn);
+        }
+    }
+}
+
+// Closes the connections idle for too long. When stopping, every
+// connection without a pending response is idle.
+static void close_idle_connections(Worker* worker, time_t now) {
+    Connection* conn = worker->connections;
+    while (conn != NULL) {
+        Connection* next = conn->next;
+        if (conn->pending == NULL && (atomic_load(&stopping) || now - conn->lastActive >= KEEPALIVE_TIMEOUT)) {
+            close_connection(worker, conn);
+        }
+        conn = next;
+    }
+}
+
+// --- Workers ---
+static int create_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(PORT),
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("listen failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    time_t shutdown_deadline = 0;
 
-        visitor_count++;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &worker->listen_fd};
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &event);
+    event.data.ptr = &shutdown_fd;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &event);
 
-        // Read request (ignored)
-        char buffer[1024] = {0};
-        read(client_fd, buffer, 1024);
+    while (1) {
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, 1000);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &worker->listen_fd) {
+                accept_connections(worker);
+            } else if (ptr == &shutdown_fd) {
+                if (shutdown_deadline == 0) {
+                    // Stop accepting, the other workers take nothing over
+                    // as they are stopping as well.
+                    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, shutdown_fd, NULL);
+                    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listen_fd, NULL);
+                    close(worker->listen_fd);
+                    shutdown_deadline = time(NULL) + SHUTDOWN_TIMEOUT;
+                }
+            } else {
+                Connection* conn = ptr;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    close_connection(worker, conn);
+                } else if (events[i].events & EPOLLOUT) {
+                    if (flush_pending(worker, conn) < 0) {
+                        close_connection(worker, conn);
+                    } else if (conn->pending == NULL) {
+                        // Requests received while sending.
+                        handle_readable(worker, conn);
+                    }
+                } else if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                    handle_readable(worker, conn);
+                }
+            }
+        }
+        close_idle_connections(worker, time(NULL));
+        if (shutdown_deadline != 0) {
+            if (worker->connections == NULL) break;
+            if (time(NULL) >= shutdown_deadline) {
+                while (worker->connections != NULL) {
+                    close_connection(worker, worker->connections);
+                }
+                break;
+            }
+        }
+    }
+    return NULL;
+}
 
-        // Send Header
-        char *header = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n";
-        send(client_fd, header, strlen(header), 0);
+static void on_signal(int signal) {
+    (void)signal;
+    atomic_store(&stopping, 1);
+    // write is async-signal-safe, every worker is woken up.
+    uint64_t one = 1;
+    ssize_t ignored = write(shutdown_fd, &one, sizeof(one));
+    (void)ignored;
+}
 
-        // Render Body using CTML with local client_fd
-        render_homepage(client_fd, visitor_count);
+// --- Main ---
+// Usage: ./server_example [workers] (one per core by default)
+int main(int argc, char** argv) {
+    int worker_count = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_count < 1) worker_count = 1;
 
-        close(client_fd);
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
     }
+    struct sigaction action = {.sa_handler = on_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
+    Worker* workers = calloc(worker_count, sizeof(Worker));
+    if (workers == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        Worker* worker = &workers[i];
+        worker->id = i;
+        worker->context = (CTML_Context){.arena = &worker->arena};
+        worker->listen_fd = create_listener();
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->listen_fd < 0 || worker->epoll_fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Server listening on http://localhost:%d with %d workers\n", PORT, worker_count);
+    fflush(stdout);
+
+    unsigned long requests = 0;
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].epoll_fd);
+        requests += workers[i].requests;
+        printf("Worker %d: %lu requests, arena peak %zu bytes, %zu allocations\n", i,
+               workers[i].requests, workers[i].arena.peak, workers[i].arena.allocations);
+        ctml_arena_free(&workers[i].arena);
+    }
+    printf("Stopped after %lu requests (cache: %llu hits, %llu misses)\n", requests,
+           (unsigned long long)ctml_cache_hits(&ctml_default_cache),
+           (unsigned long long)atomic_load(&ctml_default_cache.misses));
+    ctml_cache_clear(&ctml_default_cache);
+    free(workers);
+    close(shutdown_fd);
     return 0;
 }